@@ -26,11 +26,12 @@
  * To build
  *
  *   apt install libusb-dev libmosquitto-dev
- *   gcc cm160.c -Wall -o cm160 -lmosquitto -lusb-1.0
- *   (or  gcc cm160.c -Wall -o cm160 -lmosquitto /usr/lib/x86_64-linux-gnu/libusb-1.0.a)
+ *   gcc *.c -Wall -o cm160 -lmosquitto -lusb-1.0 -lpthread
+ *   (or  gcc *.c -Wall -o cm160 -lmosquitto -lpthread /usr/lib/x86_64-linux-gnu/libusb-1.0.a)
  *
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -40,14 +41,27 @@
 #include <malloc.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <mosquitto.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <termios.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <asm/termbits.h>       // termios2, for a baud rate termios.h can't set
 #include <libusb-1.0/libusb.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cm160.h"
+#include "publish.h"
+#include "metrics.h"
+#include "sink.h"
+#include "log.h"
 
 #define OWL_VENDOR_ID           0x0fde
 #define CM160_DEV_ID            0xca05
@@ -57,15 +71,32 @@
 #define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
 // CP210X device options
 #define CP210X_IFC_ENABLE       0x00
+#define CP210X_SET_LINE_CTL     0x03
 #define CP210X_GET_LINE_CTL     0x04
 #define CP210X_SET_MHS          0x07
 #define CP210X_GET_MDMSTS       0x08
+#define CP210X_SET_FLOW         0x13
 #define CP210X_GET_FLOW         0x14
 #define CP210X_GET_BAUDRATE     0x1D
 #define CP210X_SET_BAUDRATE     0x1E
 // CP210X_IFC_ENABLE
 #define UART_ENABLE             0x0001
 #define UART_DISABLE            0x0000
+// CP210X_SET_LINE_CTL: stop bits in bits 0-3, parity in 4-7, word length in 8-15
+#define LINE_CTL_8N1            0x0800
+// CP210X_SET_MHS: DTR and RTS on, with the mask bits saying to set both
+#define MHS_DTR_RTS_ON          0x0303
+// CP210X_GET_FLOW/SET_FLOW: ulControlHandshake and ulFlowReplace bits
+#define FLOW_DTR_MASK           0x00000003
+#define FLOW_DTR_ACTIVE         0x00000001
+#define FLOW_HANDSHAKE          0x00000078  // CTS, DSR, DCD handshaking and DSR sensitivity
+#define FLOW_RTS_MASK           0x000000C0
+#define FLOW_RTS_ACTIVE         0x00000040
+#define FLOW_XONXOFF            0x00000003  // auto transmit and receive
+#define BAUDRATE                250000
+#define CLAIM_RETRY_MS          20          // how often to try the interface until it's ready
+#define CLAIM_TIMEOUT_MS        3000        // ... and for how long
+#define RECOVERY_TIMEOUT_MS     10000       // if the link isn't back this long after resetting the line, reconnect
 // CM160 protocol
 #define BULK_ENDPOINT_IN        0x82
 #define BULK_ENDPOINT_OUT       0x01
@@ -74,23 +105,92 @@
 #define FRAME_ID_HISTORY        0x59
 #define FRAME_ID_UNKNOWN        0x1D
 #define FRAME_SIZE              11
+#define RING_SIZE               4096        // rounded up to a whole number of pages
+#define USB_PACKET_SIZE         64          // CP210x bulk endpoint max packet size
 #define MAXIDCOUNT              8
+#define BADFRAMES               3           // all-0xFF frames in a row before the line is reset
+// Bringing a device up. Each step after the claim is an asynchronous control
+// transfer, so any number of devices come up at once.
+#define STATE_RUNNING           0
+#define STATE_CLAIM             1           // waiting for the interface to be claimable
+#define STATE_GET_BAUDRATE      2           // nothing more to do if it's already right
+#define STATE_ENABLE            3
+#define STATE_SET_BAUDRATE      4
+#define STATE_DISABLE           5
+// Recovering the line of a running device, while still reading from it
+#define STATE_GET_LINE_CTL      6
+#define STATE_GET_FLOW          7
+#define STATE_SET_FLOW          8           // skipped if there's no flow control to turn off
+#define STATE_SET_LINE_CTL      9
+#define STATE_SET_MHS           10
 
 static char ID_MSG[11] =   { 0xA9, 0x49, 0x44, 0x54, 0x43, 0x4D, 0x56, 0x30, 0x30, 0x31, 0x01 };                // {A9}IDTCMV001{01}
 static char WAIT_MSG[11] = { 0xA9, 0x49, 0x44, 0x54, 0x57, 0x41, 0x49, 0x54, 0x50, 0x43, 0x52 };                // {A9}IDTWAITPCR
 
+struct cm160_struct;
+
+/**
+ * How the framing loop reaches a device. A backend reads into the ring and
+ * calls cm160_read(); the loop calls back into it to reply to the unit, to
+ * start resetting the line when the link has gone wrong, and to let the
+ * device go. There are two: libusb, driving the CP210x itself, and a tty,
+ * leaving that to the kernel's cp210x driver (or a pty standing in for one).
+ */
+typedef struct {
+    void (*reply)(struct cm160_struct *cm160, unsigned char send);
+    void (*recover)(struct cm160_struct *cm160);
+    bool (*quiesce)(struct cm160_struct *cm160);    // true once nothing is in flight
+    void (*close)(struct cm160_struct *cm160);
+} transport_t;
+
 typedef struct cm160_struct {
+    const transport_t *transport;       // NULL when replaying
+    int fd;                     // the tty, if that's how it's reached, or -1
+    const char *path;           // ... and its name
     struct libusb_transfer *transfer_in;
     struct libusb_transfer *transfer_out;
+    struct libusb_transfer *transfer_ctrl;      // CP210x configuration
+    unsigned char ctrlbuf[LIBUSB_CONTROL_SETUP_SIZE + 16];
+    uint8_t state;              // STATE_RUNNING, or how far it's got coming up or recovering
+    uint64_t initstart, stagestart, retryat;
+    uint32_t opentime, claimtime;
+    uint16_t linectl;           // as found when recovering
+    uint32_t flow[4];
+    uint64_t recoverstart;      // when the current recovery began, or 0
+    uint32_t recoveries, recoverytime, recoverymax;     // count, and milliseconds taken last time and at most
+    uint8_t badframes;          // consecutive all-0xFF frames
     struct libusb_device_handle *devh;
-    uint8_t buf[4096];
+    uint8_t *buf;               // ring buffer, mapped twice so frames never wrap
+    uint32_t ringsize;
+    uint32_t rpos, wpos;        // free-running read and write cursors
     unsigned char serial[80];
-    int buflen;
+    unsigned char outbuf[1];
     uint8_t idcount;
     uint8_t seenlivedata, kernel;
+    uint32_t skipped;           // bytes skipped in the current resync, 0 if in sync
+    uint64_t resync_events, resync_bytes;
+    meter_t *meter;             // where this device's readings are queued for the publisher
+    uint8_t id;                 // identifies the device in a capture
+    uint64_t frames;            // frames decoded
+    uint64_t readtime;          // monotonic microseconds when the last read completed
+    uint8_t inbusy, outbusy, ctrlbusy, cancelled;
+    uint8_t reply, replypending;
+    uint8_t disconnect;         // 1 = read failed, 2 = recovery failed, 3 = unplugged
     struct cm160_struct *next;
 } cm160_t;
 
+// Capture files are a sequence of these headers, each followed by "len" bytes.
+// A CAPTURE_DEVICE record gives a device's serial; a CAPTURE_DATA record is a
+// read from it, exactly as it came from USB.
+#define CAPTURE_DEVICE  0
+#define CAPTURE_DATA    1
+typedef struct {
+    uint64_t ms;                // milliseconds since 1970
+    uint32_t len;
+    uint8_t type, device;
+    uint16_t reserved;
+} capture_t;
+
 // list of cm160 devices
 cm160_t *head;
 struct mosquitto *mosq = NULL;
@@ -102,65 +202,230 @@ char hostname[100];
 char *programname;
 int voltage = 230;       // voltage used to calculate watts (Owl reports amps only)
 int debug = 0, all = 0;
+int batch_records = 0;   // if non-zero, publish history in batches of up to this many records
+int batch_bytes = 16384; // ... or this many bytes
+int batch_ms = 1000;     // ... or after this long
+int mqtt_qos = -1;       // -1 means 0, or 1 if spooling
+spool_t *spool;          // if set, messages go via this on-disk queue
+char spool_dir[200];
+int spool_max = 64;      // megabytes
+int drain_rate = 100;    // messages per second sent from the spool
+store_t *store;          // if set, every reading is also kept here
+FILE *capture;           // if set, every USB read is written here
+int quiet = 0;           // don't print readings
+int output_format = FORMAT_JSON;
+char stats_topic[100];   // if set, publish metrics here
+int stats_interval = 60; // ... this often, in seconds
+char state_dir[200];     // if set, history already published is remembered here
 time_t last;
 static volatile int active = 1;
 
 
-static uint64_t millis() {
+static void send_reply(cm160_t *cm160, unsigned char send);
+static void submit_read(cm160_t *cm160);
+static void cm160_recover(cm160_t *cm160, const char *why);
+static void cm160_recovered(cm160_t *cm160);
+
+uint64_t millis() {
     struct timeval time;
     gettimeofday(&time, NULL);
     uint64_t millis = ((uint64_t)time.tv_sec * 1000) + (time.tv_usec / 1000ULL);
     return millis;
 }
 
-int process_frame(cm160_t *cm160) {
+int thread_start(pthread_t *thread, void *(*run)(void *), void *arg) {
+    // Signals are for the main thread, which decides when to stop
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int r = pthread_create(thread, NULL, run, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return r;
+}
+
+/**
+ * Allocate a ring buffer of at least "size" bytes, mapped twice back to
+ * back. Any span of up to the ring size starting anywhere in the first
+ * copy is then contiguous in memory, so frames can be decoded in place
+ * and reads written in place even when they wrap.
+ */
+static uint8_t *ring_alloc(uint32_t *size) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t len = (*size + page - 1) / page * page;
+    int fd = memfd_create("cm160", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_print(LOG_ERROR, "ERROR: memfd_create: %s\n", strerror(errno));
+        return NULL;
+    }
+    uint8_t *ring = NULL;
+    if (ftruncate(fd, len) < 0) {
+        log_print(LOG_ERROR, "ERROR: ftruncate: %s\n", strerror(errno));
+    } else if ((ring = mmap(NULL, len * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_print(LOG_ERROR, "ERROR: mmap: %s\n", strerror(errno));
+        ring = NULL;
+    } else if (mmap(ring, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED || mmap(ring + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        log_print(LOG_ERROR, "ERROR: mmap: %s\n", strerror(errno));
+        munmap(ring, len * 2);
+        ring = NULL;
+    }
+    close(fd);
+    *size = len;
+    return ring;
+}
+
+static void ring_free(uint8_t *ring, uint32_t size) {
+    if (ring) {
+        munmap(ring, size * 2);
+    }
+}
+
+static void usb_reply(cm160_t *cm160, unsigned char send);
+
+static void LIBUSB_CALL transfer_out_done(struct libusb_transfer *transfer) {
+    cm160_t *cm160 = transfer->user_data;
+    cm160->outbusy = 0;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+            log_print(LOG_ERROR, "ERROR: reply transfer failed with status %d\n", transfer->status);
+        }
+    } else if (transfer->actual_length != 1) {
+        log_print(LOG_ERROR, "ERROR: reply transfer sent %d\n", transfer->actual_length);
+    }
+    if (cm160->replypending && !cm160->disconnect) {
+        cm160->replypending = 0;
+        usb_reply(cm160, cm160->reply);
+    }
+}
+
+/**
+ * Send a one-byte reply to the CM160 without waiting for it to go.
+ * If a reply is already in flight, this one is sent when it completes;
+ * only the most recent pending reply is kept, which is all the protocol needs.
+ */
+static void usb_reply(cm160_t *cm160, unsigned char send) {
+    if (cm160->outbusy) {
+        cm160->reply = send;
+        cm160->replypending = 1;
+        return;
+    }
+    int r;
+    cm160->outbuf[0] = send;
+    libusb_fill_bulk_transfer(cm160->transfer_out, cm160->devh, BULK_ENDPOINT_OUT, cm160->outbuf, 1, transfer_out_done, cm160, 1000);
+    if ((r=libusb_submit_transfer(cm160->transfer_out)) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_submit_transfer returned %d (%s)\n", r, libusb_strerror(r));
+    } else {
+        cm160->outbusy = 1;
+    }
+}
+
+static void send_reply(cm160_t *cm160, unsigned char send) {
+    if (cm160->transport) {
+        cm160->transport->reply(cm160, send);
+    }
+}
+
+/**
+ * Convert the date and time on the unit to seconds since 1970. This is what
+ * mktime() gives with tm_isdst set to 0, as it always has been: the unit's
+ * clock is read as standard time, so the UTC offset doesn't change during a
+ * day. mktime() is then only needed for the first reading from each day,
+ * and everything else is arithmetic - readings arrive in runs from the
+ * same day, history included.
+ */
+static time_t unit_time(int year, int mon, int mday, int hour, int min) {
+    static int cachedday = -1;
+    static time_t midnight;
+    int day = (year << 16) | ((mon & 0xFF) << 8) | mday;
+    if (day != cachedday) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year;      // wants year since 1900
+        tm.tm_mon = mon;
+        tm.tm_mday = mday;
+        midnight = mktime(&tm);
+        cachedday = day;
+    }
+    return midnight + hour * 3600 + min * 60;
+}
+
+/**
+ * Write "now" as local "HH:MM:SS" into buf, which must hold 9 bytes.
+ * The local time is only looked up once an hour.
+ */
+static void clock_format(char *buf, time_t now) {
+    static time_t hourstart = -1;
+    static int hour;
+    if (now < hourstart || now >= hourstart + 3600) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        hour = tm.tm_hour;
+        hourstart = now - tm.tm_min * 60 - tm.tm_sec;
+    }
+    int secs = now - hourstart;
+    int min = secs / 60, sec = secs % 60;
+    buf[0] = '0' + hour / 10;
+    buf[1] = '0' + hour % 10;
+    buf[2] = ':';
+    buf[3] = '0' + min / 10;
+    buf[4] = '0' + min % 10;
+    buf[5] = ':';
+    buf[6] = '0' + sec / 10;
+    buf[7] = '0' + sec % 10;
+    buf[8] = 0;
+}
+
+/**
+ * Decode the frame at the start of "frame", which has at least FRAME_SIZE
+ * bytes available. Return the number of bytes consumed, or 0 if nothing
+ * was recognised.
+ */
+int process_frame(cm160_t *cm160, const uint8_t *frame) {
+    // With --debug, each line about the frame starts with the time and the frame in hex and ASCII
+    char trace[80] = "";
     if (debug) {
-        char buf[12];
-        time_t timer = time(NULL);
-        struct tm *tm = localtime(&timer);
-        strftime(buf, sizeof(buf), "%H:%M:%S", tm);
-        printf("DEBUG: %s  ", buf);
+        static const char hex[] = "0123456789abcdef";
+        char *p = trace + sprintf(trace, "DEBUG: ");
+        clock_format(p, millis() / 1000);
+        p += strlen(p);
+        *p++ = ' ';
+        *p++ = ' ';
         for (int i=0; i<11; i++) {
-            buf[i] = cm160->buf[i];
-            if (buf[i] < 0x30 || buf[i] >= 0x80) {
-                buf[i] = '.';
-            }
-            printf("%02x ", cm160->buf[i]);
+            *p++ = hex[frame[i] >> 4];
+            *p++ = hex[frame[i] & 0xF];
+            *p++ = ' ';
+        }
+        p += sprintf(p, "   ");
+        for (int i=0; i<11; i++) {
+            *p++ = frame[i] < 0x30 || frame[i] >= 0x80 ? '.' : frame[i];
         }
-        buf[11] = 0;
-        printf("   %s  ", buf);
+        strcpy(p, "  ");
     }
 
-    if (!memcmp(cm160->buf, ID_MSG, 11)) {
+    if (!memcmp(frame, ID_MSG, 11)) {
         unsigned char send = 0x5a;
         if (debug) {
-            printf("ID frame: replying 0x%x\n", send);
-        }
-        int r, i;
-        if ((r=libusb_bulk_transfer(cm160->devh, BULK_ENDPOINT_OUT, &send, 1, &i, 1000))) {
-            printf("ERROR: libusb_bulk_transfer returned %d (%s)\n", r, libusb_strerror(r));
-        } else if (i != 1) {
-            printf("ERROR: libusb_bulk_transfer sent %d\n", i);
+            log_print(LOG_DEBUG, "%sID frame: replying 0x%x\n", trace, send);
         }
+        send_reply(cm160, send);
         cm160->idcount++;
+        METRIC_INC(cm160->meter->metrics.frames[FRAME_TYPE_ID]);
         return 11;
 
-    } else if (!memcmp(cm160->buf, WAIT_MSG, 11)) {
+    } else if (!memcmp(frame, WAIT_MSG, 11)) {
         cm160->idcount = 0;
         cm160->seenlivedata = 1;
+        cm160_recovered(cm160);
         unsigned char send = 0xa5;
         if (debug) {
-            printf("Wait frame: replying 0x%x\n", send);
-        }
-        int r, i;
-        if ((r=libusb_bulk_transfer(cm160->devh, BULK_ENDPOINT_OUT, &send, 1, &i, 1000)) < 0) {
-            printf("ERROR: libusb_bulk_transfer returned %d (%s)\n", r, libusb_strerror(r));
-        } else if (i != 1) {
-            printf("ERROR: libusb_bulk_transfer sent %d\n", i);
+            log_print(LOG_DEBUG, "%sWait frame: replying 0x%x\n", trace, send);
         }
+        send_reply(cm160, send);
+        METRIC_INC(cm160->meter->metrics.frames[FRAME_TYPE_WAIT]);
         return 11;
 
-    } else if (cm160->buf[0] == FRAME_ID_HISTORY || cm160->buf[0] == FRAME_ID_LIVE) {
+    } else if (frame[0] == FRAME_ID_HISTORY || frame[0] == FRAME_ID_LIVE) {
         // Original "eagle-owl" program decided 0x59 was "History" and 0x51 was "current.
         // But not quite right. 0x51 is "historical or no change from previous record"
         // and 0x59 means the reading is current AND the read value is different to 
@@ -192,23 +457,23 @@ int process_frame(cm160_t *cm160) {
         // And, also:
         // 59 ff ff ff ff ff ff ff ff ff 50 
         //
-        // Now srongly suspect that this indicates the USB port is in the wrong serial mode, somehow
-        // Fix with ioctl? Would be nice to fix with libusb but that means wading into 
-        // https://github.com/torvalds/linux/blob/master/drivers/usb/serial/cp210x.c
+        // Now srongly suspect that this indicates the USB port is in the wrong serial mode, somehow.
+        // A few of these in a row and we reset the CP210x's line with cm160_recover(), as
+        // https://github.com/torvalds/linux/blob/master/drivers/usb/serial/cp210x.c would
 
         cm160->idcount = 0;
-        bool newdata = cm160->buf[0] == FRAME_ID_LIVE || (cm160->buf[2] & 0x40) == 0;
+        bool newdata = frame[0] == FRAME_ID_LIVE || (frame[2] & 0x40) == 0;
         int checksum = 0;
         for (int i=0;i<10;i++) {
-            checksum += cm160->buf[i];
+            checksum += frame[i];
         }
         checksum &= 0xff;
-        if (checksum == cm160->buf[10]) {
+        if (checksum == frame[10]) {
             if (debug) {
                 if (newdata) {
-                    printf("Live frame\n");
+                    log_print(LOG_DEBUG, "%sLive frame\n", trace);
                 } else {
-                    printf("History frame\n");
+                    log_print(LOG_DEBUG, "%sHistory frame\n", trace);
                 }
             }
             // eagle-owl said bytes were
@@ -225,55 +490,356 @@ int process_frame(cm160_t *cm160) {
             if (newdata) {
                 cm160->seenlivedata = 1;
             }
-            if (cm160->seenlivedata && cm160->buf[2] != 0xFF) {        // if buf[2]==ff, everything is ff
-                struct tm *tm = calloc(sizeof(struct tm), 1);
-                tm->tm_year = cm160->buf[1] + 100;      // wants year since 1900
-                tm->tm_mon = (cm160->buf[2] & 0xF) - 1;
-                tm->tm_mday = cm160->buf[3];
-                tm->tm_hour = cm160->buf[4];
-                tm->tm_min = cm160->buf[5];
-                time_t t = mktime(tm);
-                bool avail = (cm160->buf[2] & 0x40) != 0;
-                float amps = (cm160->buf[8] + (cm160->buf[9]<<8)) * 0.07; // mean intensity during one minute
-                float watts = amps * voltage; // mean power during one minute
-                if (all || newdata) {
-                    char buf[400];
-                    sprintf(buf, "{\"type\":\"cm160\",\"serial\":\"%s\",\"amps\":%1.2f,\"watts\":%d,\"unitwhen\":%ld%s%s,\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\"}", cm160->serial, amps, (int)watts, t, (avail?",\"more\":true":""), (newdata?"":",\"old\":true"), millis()/1000, programname, hostname);
-                    mosquitto_publish(mosq, NULL, mqtt_topic, strlen(buf), buf, 0, 0);
-                    printf("%s\n", buf);
+            if (frame[1] == 0xFF && frame[2] == 0xFF) {
+                if (++cm160->badframes == BADFRAMES) {
+                    cm160->badframes = 0;
+                    cm160_recover(cm160, "reading all-0xFF frames");
+                }
+            } else {
+                cm160->badframes = 0;
+                cm160_recovered(cm160);
+            }
+            if (cm160->seenlivedata && frame[2] != 0xFF) {        // if buf[2]==ff, everything is ff
+                time_t t = unit_time(frame[1] + 100, (frame[2] & 0xF) - 1, frame[3], frame[4], frame[5]);
+                if (store || all || newdata || rollup_enabled()) {
+                    // Everything else is done by the publisher thread
+                    reading_t reading;
+                    reading.unitwhen = t;
+                    reading.when = millis() / 1000;
+                    reading.amps = frame[8] + (frame[9]<<8);              // mean intensity during one minute
+                    reading.watts = reading_watts(reading.amps, voltage); // mean power during one minute
+                    reading.more = (frame[2] & 0x40) != 0;
+                    reading.old = !newdata;
+                    reading.readtime = cm160->readtime;
+                    meter_push(cm160->meter, &reading);
+                    if (cm160->meter->latest) {
+                        latest_update(cm160->meter->latest, &reading);
+                    }
                     if (newdata) {
                         last = t;
                     }
                 }
             }
-
+            METRIC_INC(cm160->meter->metrics.frames[newdata ? FRAME_TYPE_LIVE : FRAME_TYPE_HISTORY]);
             return 11;
         } else {
             if (debug) {
                 if (newdata) {
-                    printf("Live frame (bad checksum: expected 0x%x)\n", checksum);
+                    log_print(LOG_DEBUG, "%sLive frame (bad checksum: expected 0x%x)\n", trace, checksum);
                 } else {
-                    printf("History frame (bad checksum: presuming 10-byte record)\n");
+                    log_print(LOG_DEBUG, "%sHistory frame (bad checksum: presuming 10-byte record)\n", trace);
                 }
             }
-            return newdata ? 0 : 10;
+            if (newdata) {
+                METRIC_INC(cm160->meter->metrics.checksum_errors);
+                return 0;
+            }
+            METRIC_INC(cm160->meter->metrics.frames[FRAME_TYPE_HISTORY10]);
+            return 10;
         }
 
     } else {
         cm160->idcount = 0;
-        printf("Unknown frame\n");
+        if (debug) {
+            log_print(LOG_DEBUG, "%sUnknown frame\n", trace);
+        }
+        METRIC_INC(cm160->meter->metrics.unknown_frames);
         return 0;
     }
 }
 
+/**
+ * Return the index of the first byte at or after "i" that could start a
+ * frame, or "len" if there isn't one. Uses SSE2 to test 16 bytes at once
+ * where available; the ring is mapped twice so reading ahead is safe.
+ */
+static uint32_t frame_candidate(const uint8_t *p, uint32_t i, uint32_t len) {
+#ifdef __SSE2__
+    const __m128i control = _mm_set1_epi8((char)FRAME_ID_CONTROL);
+    const __m128i live = _mm_set1_epi8((char)FRAME_ID_LIVE);
+    const __m128i history = _mm_set1_epi8((char)FRAME_ID_HISTORY);
+    for (;i + 16 <= len;i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, control), _mm_cmpeq_epi8(v, live)), _mm_cmpeq_epi8(v, history)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (;i<len;i++) {
+        if (p[i] == FRAME_ID_CONTROL || p[i] == FRAME_ID_LIVE || p[i] == FRAME_ID_HISTORY) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Called when the frame at the start of "p" couldn't be decoded: return
+ * the number of bytes to skip to reach the next plausible frame, which is
+ * at least 1. A candidate is only accepted if process_frame would accept
+ * it, so the checksum is checked here too - as a rolling sum carried from
+ * one candidate to the next rather than recomputed at each. A candidate too
+ * close to the end to check is left for the next read.
+ */
+static uint32_t frame_resync(const uint8_t *p, uint32_t len) {
+    uint32_t pos = len, sum = 0;        // sum of p[pos..pos+9]
+    uint32_t i = 1;
+    while ((i = frame_candidate(p, i, len)) < len) {
+        if (i + FRAME_SIZE > len) {
+            return i;
+        }
+        if (i > pos && i - pos < 10) {
+            for (;pos<i;pos++) {
+                sum += p[pos + 10];
+                sum -= p[pos];
+            }
+        } else {
+            sum = 0;
+            for (int j=0;j<10;j++) {
+                sum += p[i + j];
+            }
+            pos = i;
+        }
+        if (p[i] == FRAME_ID_CONTROL) {
+            if (!memcmp(p + i, ID_MSG, 11) || !memcmp(p + i, WAIT_MSG, 11)) {
+                return i;
+            }
+        } else if ((sum & 0xff) == p[i + 10] || (p[i] == FRAME_ID_HISTORY && (p[i + 2] & 0x40))) {
+            // good checksum, or a 10-byte history record
+            return i;
+        }
+        i++;
+    }
+    return len;
+}
+
+/**
+ * Process "n" bytes that have just been written into the ring at the write cursor
+ */
+static void cm160_received(cm160_t *cm160, int n) {
+    cm160->wpos += n;
+    // printf("read %d now %d\n", n, cm160->wpos - cm160->rpos);
+    while (cm160->wpos - cm160->rpos >= FRAME_SIZE) {
+        const uint8_t *frame = cm160->buf + (cm160->rpos & (cm160->ringsize - 1));
+        int r = process_frame(cm160, frame);
+        if (r == 0) {
+            // We couldn't read anything - skip to the next likely frame
+            if (!cm160->skipped) {
+                cm160->resync_events++;
+                METRIC_INC(cm160->meter->metrics.resyncs);
+            }
+            r = frame_resync(frame, cm160->wpos - cm160->rpos);
+            cm160->skipped += r;
+            cm160->resync_bytes += r;
+            METRIC_ADD(cm160->meter->metrics.resync_bytes, r);
+        } else {
+            cm160->frames++;
+            if (cm160->skipped) {
+                if (!quiet) {
+                    log_print(LOG_WARN, "Unknown frame: skipped %u bytes to resync (%" PRIu64 " bytes in %" PRIu64 " resyncs so far)\n", cm160->skipped, cm160->resync_bytes, cm160->resync_events);
+                }
+                cm160->skipped = 0;
+            }
+        }
+        cm160->rpos += r;
+    }
+}
+
+/**
+ * Write a record to a capture file
+ */
+static void capture_write(FILE *f, uint8_t type, uint8_t device, const void *data, uint32_t len) {
+    capture_t c;
+    memset(&c, 0, sizeof(c));
+    c.ms = millis();
+    c.len = len;
+    c.type = type;
+    c.device = device;
+    if (fwrite(&c, sizeof(c), 1, f) != 1 || fwrite(data, 1, len, f) != len) {
+        log_print(LOG_ERROR, "ERROR: capture: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * A backend has read "n" bytes from the device into the ring at the write cursor
+ */
+static void cm160_read(cm160_t *cm160, int n) {
+    if (capture && n) {
+        capture_write(capture, CAPTURE_DATA, cm160->id, cm160->buf + (cm160->wpos & (cm160->ringsize - 1)), n);
+    }
+    cm160->readtime = monotonic_us();
+    cm160_received(cm160, n);
+    if (cm160->idcount >= MAXIDCOUNT) {
+        // Seems to get stuck. It's not hearing our replies - "ID Frame"
+        // means "I haven't heard from the server for a while"
+        cm160->idcount = 0;
+        cm160_recover(cm160, "stuck in ID frame loop");
+    }
+}
+
+static void LIBUSB_CALL transfer_in_done(struct libusb_transfer *transfer) {
+    cm160_t *cm160 = transfer->user_data;
+    cm160->inbusy = 0;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        cm160_read(cm160, transfer->actual_length);
+    }
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        return;
+    } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        log_print(LOG_ERROR, "ERROR: read transfer failed with status %d\n", transfer->status);
+        cm160->disconnect = 1;
+    }
+    if (!cm160->disconnect) {
+        submit_read(cm160);
+    }
+}
+
+/**
+ * Queue a read into whatever space is left in the ring. Every connected
+ * device always has one of these outstanding; the completion callback
+ * frames and processes the data then resubmits. Because the ring is
+ * mapped twice the free space is always contiguous, so the transfer
+ * writes straight into it. The length is kept to a whole number of
+ * packets, or libusb reports an overflow.
+ */
+static void submit_read(cm160_t *cm160) {
+    int r;
+    uint32_t space = cm160->ringsize - (cm160->wpos - cm160->rpos);
+    space -= space % USB_PACKET_SIZE;
+    libusb_fill_bulk_transfer(cm160->transfer_in, cm160->devh, BULK_ENDPOINT_IN, cm160->buf + (cm160->wpos & (cm160->ringsize - 1)), space, transfer_in_done, cm160, 20000);
+    if ((r=libusb_submit_transfer(cm160->transfer_in)) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_submit_transfer returned %d (%s)\n", r, libusb_strerror(r));
+        cm160->disconnect = 1;
+    } else {
+        cm160->inbusy = 1;
+    }
+}
+
+/**
+ * Allocate a device and its ring buffer. Returns NULL on failure.
+ */
+static cm160_t *cm160_new() {
+    static uint8_t nextid;
+    cm160_t *cm160 = calloc(sizeof(struct cm160_struct), 1);
+    cm160->ringsize = RING_SIZE;
+    if (!(cm160->buf = ring_alloc(&cm160->ringsize))) {
+        free(cm160);
+        return NULL;
+    }
+    cm160->id = nextid++;
+    cm160->fd = -1;
+    return cm160;
+}
+
+/**
+ * Called once the device's serial number is known
+ */
+static void cm160_named(cm160_t *cm160) {
+    cm160->meter = meter_get((const char *)cm160->serial);
+    if (capture) {
+        capture_write(capture, CAPTURE_DEVICE, cm160->id, cm160->serial, strlen((const char *)cm160->serial));
+    }
+}
+
+/**
+ * Release the USB device. Transfers must not be in flight.
+ */
+static void usb_close(cm160_t *cm160) {
+    if (cm160->devh) {
+        libusb_release_interface(cm160->devh, USB_INTERFACE);
+        if (cm160->kernel) {
+            libusb_attach_kernel_driver(cm160->devh, USB_INTERFACE);
+        }
+        libusb_close(cm160->devh);
+    }
+    libusb_free_transfer(cm160->transfer_in);
+    libusb_free_transfer(cm160->transfer_out);
+    libusb_free_transfer(cm160->transfer_ctrl);
+}
+
+/**
+ * Let go of the device and free it. It must have been quiesced.
+ */
+static void cm160_close(cm160_t *cm160) {
+    if (cm160->transport) {
+        cm160->transport->close(cm160);
+    }
+    ring_free(cm160->buf, cm160->ringsize);
+    free(cm160);
+}
+
+/**
+ * Cancel any transfers in flight for a device we're dropping. Returns true
+ * once nothing is outstanding and the device can be closed.
+ */
+static bool usb_quiesce(cm160_t *cm160) {
+    if (!cm160->cancelled) {
+        if (cm160->inbusy) {
+            libusb_cancel_transfer(cm160->transfer_in);
+        }
+        if (cm160->outbusy) {
+            libusb_cancel_transfer(cm160->transfer_out);
+        }
+        if (cm160->ctrlbusy) {
+            libusb_cancel_transfer(cm160->transfer_ctrl);
+        }
+        cm160->replypending = 0;
+        cm160->cancelled = 1;
+    }
+    return !cm160->inbusy && !cm160->outbusy && !cm160->ctrlbusy;
+}
+
+static bool cm160_quiesce(cm160_t *cm160) {
+    return !cm160->transport || cm160->transport->quiesce(cm160);
+}
+
 void usage() {
-    printf("Usage: %s [--debug] [--all] [--host <mqtt-server>] [--port <mqtt-port>] [--topic <mqtt-topic>] [--announce-topic <mqtt-topic>] [--voltage <voltage>]\n\n", programname);
-    printf(" --debug           log everything to stdout\n");
+    printf("Usage: %s [--debug] [--all] [--host <mqtt-server>] [--port <mqtt-port>] [--topic <mqtt-topic>] [--announce-topic <mqtt-topic>] [--stats-topic <mqtt-topic> [--stats-interval <secs>]] [--metrics-port <port>] [--voltage <voltage>] [--batch <records>] [--batch-bytes <bytes>] [--batch-ms <ms>] [--qos <qos>] [--spool <dir>] [--spool-max <mb>] [--drain-rate <msgs/sec>] [--format <format>] [--store <dir>] [--state <dir>] [--rollup <windows>] [--filter [<serial>=]<watts>,<percent>,<min-secs>,<heartbeat-secs>] [--sink <sink>] [--latest-shm <name>] [--latest-socket <path>] [--tty <device>] [--capture <file>] [--replay <file> [--replay-speed <speed>]] [--bench]\n\n", programname);
+    printf(" --debug           log every frame to stdout; --capture keeps a binary trace without formatting it\n");
     printf(" --all             report historical data (there can be a lot of it)\n");
     printf(" --host            the MQTT host to talk to (default: localhost)\n");
     printf(" --topic           the MQTT topic (default: cm160)\n");
     printf(" --announce-topic  if set, the MQTT topic to announce program start and stop (default: not set)\n");
+    printf(" --stats-topic     if set, the MQTT topic to publish each device's counters and latency to (default: not set)\n");
+    printf(" --stats-interval  how often to publish to --stats-topic in seconds (default: 60)\n");
+    printf(" --metrics-port    serve the same in Prometheus format at http://127.0.0.1:<port>/metrics (default: off)\n");
     printf(" --voltage         the system voltage to calculate watts from amps (default: 230)\n");
+    printf(" --batch           with --all, publish historical data as JSON arrays of up to this many records (default: off)\n");
+    printf(" --batch-bytes     the maximum size of a batch in bytes, at most 1047552 with --spool (default: 16384)\n");
+    printf(" --batch-ms        the longest a record waits in a batch in milliseconds (default: 1000)\n");
+    printf(" --qos             the MQTT QoS to publish readings with (default: 0, or 1 with --spool)\n");
+    printf(" --spool           queue readings in this directory until the broker has them (default: not set)\n");
+    printf(" --spool-max       the most disk the spool may use in megabytes; when full the oldest are dropped (default: 64)\n");
+    printf(" --drain-rate      the most messages per second to send from the spool (default: 100)\n");
+    printf(" --format          publish readings as \"json\", \"cbor\", \"influx\" line protocol or packed \"binary\" (default: json)\n");
+    printf(" --store           keep every reading, including history, in this directory (default: not set)\n");
+    printf(" --state           remember the history published in this directory, so it's only published once (default: not set)\n");
+    printf(" --rollup          publish energy used over these windows to <topic>/rollup/<window>, like \"15m,1h,1d\" (default: not set)\n");
+    printf(" --filter          only publish live readings that differ from the last published by more than <watts> and\n");
+    printf("                   <percent>, at most every <min-secs>, but at least every <heartbeat-secs>; 0 turns each off.\n");
+    printf("                   With <serial>= it's only for that device, and may be repeated (default: publish all)\n");
+    printf(" --sink            also send readings to \"udp:<address>:<port>\", \"unix:<path>\" or \"file:<path>\", followed by\n");
+    printf("                   options \",queue=<n>,batch=<n>,ms=<ms>,policy=drop|block\", \",ttl=<hops>\" for udp, or\n");
+    printf("                   \",size=<mb>,keep=<files>\" for file rotation. May be repeated (default: none)\n");
+    printf(" --latest-shm      keep each device's latest reading and last hour by minute in /dev/shm/<name>,\n");
+    printf("                   laid out as in latest.h (default: not set)\n");
+    printf(" --latest-socket   answer requests for the same on this unix socket: send a serial, or an empty line\n");
+    printf("                   for every device, and get back a line of JSON (default: not set)\n");
+    printf(" --tty             read this tty, like /dev/ttyUSB0, through the kernel's cp210x driver instead of using\n");
+    printf("                   libusb to find devices. May be repeated (default: not set)\n");
+    printf(" --capture         write every USB read to this file, for --replay (default: not set)\n");
+    printf(" --replay          read from this file written by --capture instead of USB; readings are only\n");
+    printf("                   published if --host is given (default: not set)\n");
+    printf(" --replay-speed    replay this many times faster than it was captured, or 0 for flat out (default: 1)\n");
+    printf(" --bench           time the decoder on built-in live, history, 10-byte history and corrupt captures,\n");
+    printf("                   and the --replay file if given, then exit. Build with -DCM160_BENCH to count allocations\n");
+    printf("\n");
+    printf("Usage: %s --query <dir> [--serial <serial>] [--from <time>] [--to <time>] [--group <interval>] [--voltage <voltage>]\n\n", programname);
+    printf(" --query           print energy used from the readings kept with --store, then exit\n");
+    printf(" --serial          only report this device (default: all)\n");
+    printf(" --from, --to      the range to report, as seconds since 1970, YYYY-MM-DD or \"YYYY-MM-DD HH:MM\" (default: everything)\n");
+    printf(" --group           report each \"minute\", \"hour\", \"day\" or this many seconds separately (default: the whole range)\n");
     printf("\n");
     printf("MQTT reports include \"unitwhen\" (date set on the unit) and \"when\" (date message received). \"unitwhen\"\n");
     printf("may not be correct and may go backwards if historical data is being reported.\n");
@@ -281,26 +847,978 @@ void usage() {
     exit(-1);
 }
 
-static void mqttConnect(struct mosquitto *mosq, void *obj, int rc) {
-    if (rc) {
-        printf("MQTT: connect to %s:%d failed: %d\n", mqtt_server, mqtt_port, rc);
-    } else {
-        printf("MQTT: connected to %s:%d\n", mqtt_server, mqtt_port);
+/**
+ * Parse a time given as seconds since 1970, "YYYY-MM-DD" or "YYYY-MM-DD HH:MM"
+ * in local time. Returns -1 if it's none of those.
+ */
+static time_t parse_time(const char *s) {
+    char *c;
+    long v = strtol(s, &c, 10);
+    if (!*c && c != s) {
+        return v;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!(c = strptime(s, "%Y-%m-%d", &tm))) {
+        return -1;
+    }
+    if (*c && (!(c = strptime(c, " %H:%M", &tm)) || *c)) {
+        return -1;
     }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
 }
 
 void cancel() {
     active = 0;
 }
 
+/**
+ * Copy "len" bytes into the ring as if they'd been read from USB, and process them
+ */
+static void cm160_feed(cm160_t *cm160, const uint8_t *data, uint32_t len) {
+    while (len) {
+        uint32_t n = cm160->ringsize - (cm160->wpos - cm160->rpos);
+        if (n > len) {
+            n = len;
+        }
+        memcpy(cm160->buf + (cm160->wpos & (cm160->ringsize - 1)), data, n);
+        cm160->readtime = monotonic_us();
+        cm160_received(cm160, n);
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Map a capture file, returning its length or -1
+ */
+static ssize_t capture_map(const char *path, const uint8_t **map) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_print(LOG_ERROR, "ERROR: replay: \"%s\": %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (*map == MAP_FAILED) {
+        log_print(LOG_ERROR, "ERROR: replay: \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+    return st.st_size;
+}
+
+/**
+ * Feed a capture through the framing loop as if it were coming from USB.
+ * With "speed" 1 the reads are spaced as they were captured, 2 is twice as
+ * fast and so on, and 0 is as fast as possible. Replies to the unit go nowhere.
+ */
+static void replay(const char *path, double speed) {
+    const uint8_t *map;
+    ssize_t size = capture_map(path, &map);
+    if (size < 0) {
+        return;
+    }
+    cm160_t *devices[256] = { NULL };
+    uint64_t first = 0, start = millis();
+    size_t off = 0;
+    while (active && off + sizeof(capture_t) <= (size_t)size) {
+        capture_t c;
+        memcpy(&c, map + off, sizeof(c));
+        off += sizeof(c);
+        if (c.len > size - off) {
+            log_print(LOG_ERROR, "ERROR: replay: \"%s\" is truncated\n", path);
+            break;
+        }
+        cm160_t *cm160 = devices[c.device];
+        if (!cm160) {
+            if (!(cm160 = devices[c.device] = cm160_new())) {
+                break;
+            }
+            snprintf((char *)cm160->serial, sizeof(cm160->serial), "replay-%d", c.device);
+            cm160->next = head;
+            head = cm160;
+            if (c.type != CAPTURE_DEVICE) {
+                cm160_named(cm160);
+            }
+        }
+        if (c.type == CAPTURE_DEVICE) {
+            int len = c.len < sizeof(cm160->serial) - 1 ? c.len : sizeof(cm160->serial) - 1;
+            memcpy(cm160->serial, map + off, len);
+            cm160->serial[len] = 0;
+            cm160_named(cm160);
+        } else if (c.type == CAPTURE_DATA) {
+            if (speed > 0) {
+                if (!first) {
+                    first = c.ms;
+                }
+                uint64_t due = start + (uint64_t)((c.ms - first) / speed);
+                uint64_t now;
+                while (active && (now = millis()) < due) {
+                    usleep((due - now < 1000 ? due - now : 1000) * 1000);
+                }
+            }
+            cm160_feed(cm160, map + off, c.len);
+        }
+        off += c.len;
+    }
+    if (map) {
+        munmap((void *)map, size);
+    }
+    while (head) {
+        cm160_t *cm160 = head;
+        head = cm160->next;
+        log_print(LOG_INFO, "Replay: %s: %" PRIu64 " frames, %" PRIu64 " bytes skipped in %" PRIu64 " resyncs\n", cm160->serial, cm160->frames, cm160->resync_bytes, cm160->resync_events);
+        cm160_close(cm160);
+    }
+}
+
+#ifdef CM160_BENCH
+// Count allocations so --bench can report them. The real work is still done by
+// glibc's allocator, through its __libc_ entry points.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static uint64_t allocations;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/**
+ * Write a CM160 data frame for the benchmark, returning its length. A
+ * "tenbyte" frame leaves out the minute, as some history records do.
+ */
+static int bench_frame(uint8_t *p, uint8_t id, uint8_t month, int n, bool tenbyte) {
+    uint8_t *q = p;
+    uint16_t amps = 40 + (n * 7) % 300;
+    *q++ = id;
+    *q++ = 23;                  // year
+    *q++ = month;
+    *q++ = 1 + (n / 1440) % 28; // day
+    *q++ = (n / 60) % 24;       // hour
+    if (!tenbyte) {
+        *q++ = n % 60;          // minute
+    }
+    *q++ = 0xc4;                // tariff
+    *q++ = 0x09;
+    *q++ = amps;
+    *q++ = amps >> 8;
+    int checksum = 0;
+    for (uint8_t *c=p;c<q;c++) {
+        checksum += *c;
+    }
+    *q++ = checksum;
+    return q - p;
+}
+
+/**
+ * Run a stream through the decoder for about a second, in 64-byte reads
+ * like USB, and report how fast it went
+ */
+static void bench_run(const char *name, const uint8_t *data, size_t len) {
+    cm160_t *cm160 = cm160_new();
+    if (!cm160) {
+        return;
+    }
+    strcpy((char *)cm160->serial, "BENCH");
+    cm160_named(cm160);
+    struct timespec t0, t1;
+    uint64_t bytes = 0, elapsed;
+#ifdef CM160_BENCH
+    uint64_t allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        for (size_t off=0;off<len;off+=USB_PACKET_SIZE) {
+            cm160_feed(cm160, data + off, len - off < USB_PACKET_SIZE ? len - off : USB_PACKET_SIZE);
+            publisher_poll();
+        }
+        bytes += len;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        elapsed = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    } while (active && elapsed < 1000000000ULL);
+    uint64_t frames = cm160->frames ? cm160->frames : 1;
+    printf("%-16s %10" PRIu64 " frames %12.0f frames/sec %8.1f ns/frame %8" PRIu64 " resync bytes", name, cm160->frames, cm160->frames * 1e9 / elapsed, (double)elapsed / frames, cm160->resync_bytes);
+#ifdef CM160_BENCH
+    printf(" %6.3f allocs/frame\n", (double)(__atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs) / frames);
+#else
+    printf("\n");
+#endif
+    (void)bytes;
+    cm160_close(cm160);
+}
+
+/**
+ * Time the decoder and publish path on built-in captures of live data,
+ * history, 10-byte history and a corrupt stream, then on "path" if set.
+ * Everything is decoded and serialised but only published if a spool or
+ * store is set up. There's no publisher thread: the queues are drained
+ * after each read, so the time includes both sides.
+ */
+static void bench(const char *path) {
+    size_t size = 64 * 1024;
+    uint8_t *data = malloc(size + 64);
+    all = 1;
+    quiet = 1;
+    for (int stream=0;stream<4;stream++) {
+        uint8_t *p = data;
+        memcpy(p, WAIT_MSG, FRAME_SIZE);
+        p += FRAME_SIZE;
+        srand(1);
+        for (int n=0;p - data < (ssize_t)size - 2 * FRAME_SIZE;n++) {
+            switch (stream) {
+                case 0:                 // live
+                    p += bench_frame(p, n % 10 ? FRAME_ID_LIVE : FRAME_ID_HISTORY, 0x01, n, false);
+                    break;
+                case 1:                 // history
+                    p += bench_frame(p, FRAME_ID_HISTORY, 0x41, n, false);
+                    break;
+                case 2:                 // 10-byte history
+                    p += bench_frame(p, FRAME_ID_HISTORY, 0xc1, n, true);
+                    break;
+                case 3:                 // live frames with runs of noise between
+                    if (n % 4 == 0) {
+                        for (int i=rand() % FRAME_SIZE * 2;i>0;i--) {
+                            *p++ = rand();
+                        }
+                    }
+                    p += bench_frame(p, FRAME_ID_LIVE, 0x01, n, false);
+                    break;
+            }
+        }
+        static const char *names[] = { "live", "history", "history-10byte", "corrupt" };
+        bench_run(names[stream], data, p - data);
+    }
+    free(data);
+    if (strlen(path)) {
+        const uint8_t *map;
+        ssize_t len = capture_map(path, &map);
+        if (len > 0) {
+            // Concatenate the reads from the capture into one stream
+            uint8_t *stream = malloc(len), *p = stream;
+            for (size_t off=0;off + sizeof(capture_t) <= (size_t)len;) {
+                capture_t c;
+                memcpy(&c, map + off, sizeof(c));
+                off += sizeof(c);
+                if (c.len > len - off) {
+                    break;
+                }
+                if (c.type == CAPTURE_DATA) {
+                    memcpy(p, map + off, c.len);
+                    p += c.len;
+                }
+                off += c.len;
+            }
+            munmap((void *)map, len);
+            bench_run(path, stream, p - stream);
+            free(stream);
+        }
+    }
+}
+
+static const char *control_stages[] = { "running", "claim", "get baud rate", "UART enable", "set baud rate", "UART disable", "get line control", "get flow control", "set flow control", "set line control", "set modem handshaking" };
+
+/**
+ * The device is configured: start reading from it
+ */
+static void cm160_running(cm160_t *cm160, bool configured) {
+    if (cm160->disconnect) {
+        return;         // being dropped, and usb_quiesce() wouldn't cancel a new read
+    }
+    uint64_t now = millis();
+    cm160->state = STATE_RUNNING;
+    METRIC_INC(cm160->meter->metrics.connects);
+    log_print(LOG_INFO, "CM160: %s connected in %" PRIu64 "ms (open %ums, claim %ums, configure %" PRIu64 "ms%s)\n", cm160->serial, now - cm160->initstart, cm160->opentime, cm160->claimtime, now - cm160->stagestart, configured ? ", baud rate was already set" : "");
+    submit_read(cm160);
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void LIBUSB_CALL control_done(struct libusb_transfer *transfer);
+
+/**
+ * Send the control transfer for the stage the device has reached
+ */
+static void control_submit(cm160_t *cm160) {
+    unsigned char *buf = cm160->ctrlbuf, *data = buf + LIBUSB_CONTROL_SETUP_SIZE;
+    int in = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN;
+    int out = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT;
+    int r;
+    // See https://www.silabs.com/documents/public/application-notes/AN571.pdf
+    switch (cm160->state) {
+        case STATE_GET_BAUDRATE:
+            libusb_fill_control_setup(buf, in, CP210X_GET_BAUDRATE, 0, USB_INTERFACE, 4);
+            break;
+        case STATE_ENABLE:
+            libusb_fill_control_setup(buf, out, CP210X_IFC_ENABLE, UART_ENABLE, USB_INTERFACE, 0);
+            break;
+        case STATE_SET_BAUDRATE:
+            libusb_fill_control_setup(buf, out, CP210X_SET_BAUDRATE, 0, USB_INTERFACE, 4);
+            for (int i=0;i<4;i++) {
+                data[i] = BAUDRATE >> (i * 8);      // little-endian
+            }
+            break;
+        case STATE_DISABLE:
+            libusb_fill_control_setup(buf, out, CP210X_IFC_ENABLE, UART_DISABLE, USB_INTERFACE, 0);
+            break;
+        case STATE_GET_LINE_CTL:
+            libusb_fill_control_setup(buf, in, CP210X_GET_LINE_CTL, 0, USB_INTERFACE, 2);
+            break;
+        case STATE_GET_FLOW:
+            libusb_fill_control_setup(buf, in, CP210X_GET_FLOW, 0, USB_INTERFACE, 16);
+            break;
+        case STATE_SET_FLOW: {
+            // Turn off any handshaking, keeping the XON/XOFF limits as they were
+            uint32_t flow[4] = { (cm160->flow[0] & ~(FLOW_DTR_MASK | FLOW_HANDSHAKE)) | FLOW_DTR_ACTIVE, (cm160->flow[1] & ~(FLOW_RTS_MASK | FLOW_XONXOFF)) | FLOW_RTS_ACTIVE, cm160->flow[2], cm160->flow[3] };
+            libusb_fill_control_setup(buf, out, CP210X_SET_FLOW, 0, USB_INTERFACE, 16);
+            for (int i=0;i<16;i++) {
+                data[i] = flow[i / 4] >> ((i % 4) * 8);
+            }
+            break;
+        }
+        case STATE_SET_LINE_CTL:
+            libusb_fill_control_setup(buf, out, CP210X_SET_LINE_CTL, LINE_CTL_8N1, USB_INTERFACE, 0);
+            break;
+        case STATE_SET_MHS:
+            libusb_fill_control_setup(buf, out, CP210X_SET_MHS, MHS_DTR_RTS_ON, USB_INTERFACE, 0);
+            break;
+    }
+    libusb_fill_control_transfer(cm160->transfer_ctrl, cm160->devh, buf, control_done, cm160, 500);
+    if ((r=libusb_submit_transfer(cm160->transfer_ctrl)) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_submit_transfer (%s) returned %d (%s)\n", control_stages[cm160->state], r, libusb_strerror(r));
+        cm160->disconnect = 1;
+    } else {
+        cm160->ctrlbusy = 1;
+    }
+}
+
+static void LIBUSB_CALL control_done(struct libusb_transfer *transfer) {
+    cm160_t *cm160 = transfer->user_data;
+    unsigned char *data = libusb_control_transfer_get_data(transfer);
+    bool ok = transfer->status == LIBUSB_TRANSFER_COMPLETED;
+    cm160->ctrlbusy = 0;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED || cm160->disconnect) {
+        // A transfer that completed just as it was cancelled lands here too,
+        // and nothing more must be submitted for a device being dropped
+        return;
+    } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        cm160->disconnect = 1;
+        return;
+    } else if (!ok) {
+        // Carry on regardless, as we always have
+        log_print(LOG_ERROR, "ERROR: CP210x %s failed with status %d\n", control_stages[cm160->state], transfer->status);
+    }
+    switch (cm160->state) {
+        case STATE_GET_BAUDRATE: {
+            uint32_t baudrate = ok && transfer->actual_length == 4 ? le32(data) : 0;
+            if (baudrate == BAUDRATE) {
+                // Left like this by an earlier run, so the rest would change nothing
+                cm160_running(cm160, true);
+                return;
+            }
+            if (debug) {
+                log_print(LOG_INFO, "CM160: %s baud rate is %u, setting %d\n", cm160->serial, baudrate, BAUDRATE);
+            }
+            break;
+        }
+        case STATE_DISABLE:
+            cm160_running(cm160, false);
+            return;
+        case STATE_GET_LINE_CTL:
+            cm160->linectl = ok && transfer->actual_length == 2 ? data[0] | (data[1] << 8) : 0xFFFF;
+            break;
+        case STATE_GET_FLOW:
+            if (ok && transfer->actual_length == 16) {
+                for (int i=0;i<4;i++) {
+                    cm160->flow[i] = le32(data + i * 4);
+                }
+                if (!(cm160->flow[0] & FLOW_HANDSHAKE) && (cm160->flow[1] & (FLOW_RTS_MASK | FLOW_XONXOFF)) == FLOW_RTS_ACTIVE) {
+                    cm160->state++;     // no flow control, as it should be
+                }
+            } else {
+                cm160->state++;         // don't set what we couldn't read
+            }
+            break;
+        case STATE_SET_FLOW:
+            if (debug) {
+                log_print(LOG_INFO, "CM160: %s flow control was 0x%08x/0x%08x, turned it off\n", cm160->serial, cm160->flow[0], cm160->flow[1]);
+            }
+            break;
+        case STATE_SET_MHS:
+            log_print(LOG_INFO, "CM160: %s line reset (line control was 0x%04x, flow control 0x%08x/0x%08x)\n", cm160->serial, cm160->linectl, cm160->flow[0], cm160->flow[1]);
+            cm160->state = STATE_RUNNING;
+            return;
+    }
+    cm160->state++;
+    control_submit(cm160);
+}
+
+/**
+ * Put the CP210x's line back to 8N1 with no flow control and DTR and RTS
+ * raised, which is what reopening it as a tty used to do, while carrying
+ * on reading
+ */
+static void usb_recover(cm160_t *cm160) {
+    cm160->state = STATE_GET_LINE_CTL;
+    control_submit(cm160);
+}
+
+static const transport_t usb_transport = { usb_reply, usb_recover, usb_quiesce, usb_close };
+
+/**
+ * The link has gone wrong - the unit isn't hearing our replies, or what we
+ * read from it is garbage. Have the backend reset the line while carrying
+ * on reading. If that was already tried
+ * RECOVERY_TIMEOUT_MS ago without success, reconnect the device instead.
+ */
+static void cm160_recover(cm160_t *cm160, const char *why) {
+    uint64_t now = millis();
+    if (!cm160->transport || cm160->disconnect) {
+        return;         // replaying
+    }
+    if (cm160->recoverstart) {
+        if (cm160->state == STATE_RUNNING && now - cm160->recoverstart >= RECOVERY_TIMEOUT_MS) {
+            log_print(LOG_ERROR, "ERROR: %s: %s after resetting the line, reconnecting\n", cm160->serial, why);
+            cm160->recoverstart = 0;
+            cm160->disconnect = 2;
+            METRIC_INC(cm160->meter->metrics.recovery_failures);
+        }
+        return;
+    }
+    if (cm160->state != STATE_RUNNING || cm160->ctrlbusy) {
+        return;
+    }
+    log_print(LOG_WARN, "CM160: %s: %s, resetting the line\n", cm160->serial, why);
+    cm160->recoverstart = now;
+    cm160->recoveries++;
+    METRIC_INC(cm160->meter->metrics.recoveries);
+    cm160->transport->recover(cm160);
+}
+
+/**
+ * A good frame has arrived: if the line was being recovered, it has been
+ */
+static void cm160_recovered(cm160_t *cm160) {
+    if (cm160->recoverstart && cm160->state == STATE_RUNNING) {
+        cm160->recoverytime = millis() - cm160->recoverstart;
+        if (cm160->recoverytime > cm160->recoverymax) {
+            cm160->recoverymax = cm160->recoverytime;
+        }
+        cm160->recoverstart = 0;
+        metrics_recovery(&cm160->meter->metrics, cm160->recoverytime);
+        log_print(LOG_INFO, "CM160: %s recovered in %ums (%u recoveries, longest %ums)\n", cm160->serial, cm160->recoverytime, cm160->recoveries, cm160->recoverymax);
+    }
+}
+
+/**
+ * Try to claim the interface of every device waiting for it, and start
+ * configuring those that succeed. A device isn't claimable for a while
+ * after its configuration is set; this replaces a fixed sleep(1) with
+ * asking every CLAIM_RETRY_MS. Returns the milliseconds until the next try
+ * is due, or 1000 if none is.
+ */
+static int init_poll() {
+    uint64_t now = millis();
+    int wait = 1000;
+    for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
+        if (cm160->state != STATE_CLAIM || cm160->disconnect) {
+            continue;
+        }
+        if (cm160->retryat <= now) {
+            int r = libusb_claim_interface(cm160->devh, USB_INTERFACE);
+            if (!r) {
+                cm160->claimtime = now - cm160->stagestart;
+                cm160->stagestart = now;
+                cm160->state = STATE_GET_BAUDRATE;
+                control_submit(cm160);
+                continue;
+            } else if (now - cm160->stagestart >= CLAIM_TIMEOUT_MS || r == LIBUSB_ERROR_NO_DEVICE) {
+                log_print(LOG_ERROR, "ERROR: libusb_claim_interface returned %d (%s)\n", r, libusb_strerror(r));
+                cm160->disconnect = 1;
+                continue;
+            }
+            cm160->retryat = now + CLAIM_RETRY_MS;
+        }
+        if (cm160->retryat - now < (uint64_t)wait) {
+            wait = cm160->retryat - now;
+        }
+    }
+    return wait;
+}
+
+/**
+ * Open a CM160 and start bringing it up; init_poll() and the control
+ * transfer callbacks do the rest. Returns NULL on failure, having printed why.
+ */
+static cm160_t *cm160_open(libusb_device *device, const struct libusb_device_descriptor *desc) {
+    int r, config;
+    cm160_t *cm160 = cm160_new();
+    if (!cm160) {
+        return NULL;
+    }
+    cm160->initstart = millis();
+    cm160->transport = &usb_transport;
+    if ((r=libusb_open(device, &(cm160->devh))) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_open returned %d (%s)\n", r, libusb_strerror(r));
+        cm160->devh = NULL;
+        cm160_close(cm160);
+        return NULL;
+    }
+    cm160->transfer_in = libusb_alloc_transfer(0);
+    cm160->transfer_out = libusb_alloc_transfer(0);
+    cm160->transfer_ctrl = libusb_alloc_transfer(0);
+    if (!cm160->transfer_in || !cm160->transfer_out || !cm160->transfer_ctrl) {
+        log_print(LOG_ERROR, "ERROR: libusb_alloc_transfer failed\n");
+        cm160_close(cm160);
+        return NULL;
+    }
+    if ((r=libusb_get_string_descriptor_ascii(cm160->devh, desc->iSerialNumber, cm160->serial, sizeof(cm160->serial))) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_get_string_descriptor_ascii returned %d (%s)\n", r, libusb_strerror(r));
+    }
+    cm160_named(cm160);
+    if (libusb_kernel_driver_active(cm160->devh, USB_INTERFACE)) {
+        if (libusb_detach_kernel_driver(cm160->devh, 0)) {
+            log_print(LOG_ERROR, "ERROR: libusb_detach_kernel_driver failed\n");
+        }
+        cm160->kernel = 1;
+    }
+    libusb_set_auto_detach_kernel_driver(cm160->devh, 1);
+    // Setting the configuration resets the device, so only do it if it's needed
+    if (libusb_get_configuration(cm160->devh, &config) || config != USB_CONFIGURATION) {
+        if ((r = libusb_set_configuration(cm160->devh, USB_CONFIGURATION))) {
+            log_print(LOG_ERROR, "ERROR: libusb_set_configuration returned %d (%s)\n", r, libusb_strerror(r));
+        }
+    }
+    cm160->stagestart = cm160->retryat = millis();
+    cm160->opentime = cm160->stagestart - cm160->initstart;
+    cm160->state = STATE_CLAIM;
+    return cm160;
+}
+
+/**
+ * Open "device" and add it to the list if it's a CM160 we don't already have
+ */
+static void device_add(libusb_device *device) {
+    static struct libusb_device_descriptor desc;
+    int r;
+    for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
+        if (cm160->devh && libusb_get_device(cm160->devh) == device) {
+            return;
+        }
+    }
+    if ((r=libusb_get_device_descriptor(device, &desc)) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_get_device_descriptor returned %d (%s)\n", r, libusb_strerror(r));
+    } else if (desc.idVendor == OWL_VENDOR_ID && desc.idProduct == CM160_DEV_ID) {
+        cm160_t *cm160 = cm160_open(device, &desc);
+        if (cm160) {
+            cm160->next = head;
+            head = cm160;
+        }
+    }
+}
+
+/**
+ * Look at every device on the bus. Only needed if hotplug isn't available,
+ * or to pick up a device we dropped but which is still plugged in.
+ */
+static void device_scan(libusb_context *context) {
+    libusb_device **list = NULL;
+    int count = libusb_get_device_list(context, &list);
+    if (count < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_get_device_list returned %d (%s)\n", count, libusb_strerror(count));
+        return;
+    }
+    for (int i = 0;i<count;i++) {
+        device_add(list[i]);
+    }
+    libusb_free_device_list(list, 1);
+}
+
+// Devices that have arrived since the event loop last looked. Opening one
+// does I/O, which isn't allowed in a hotplug callback, so it's done later.
+#define MAXARRIVALS 8
+static libusb_device *arrivals[MAXARRIVALS];
+static int arrivalcount;
+static bool arrivals_lost;
+
+static int LIBUSB_CALL hotplug_event(libusb_context *context, libusb_device *device, libusb_hotplug_event event, void *user_data) {
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        if (arrivalcount < MAXARRIVALS) {
+            arrivals[arrivalcount++] = libusb_ref_device(device);
+        } else {
+            arrivals_lost = true;
+        }
+    } else {
+        for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
+            if (cm160->devh && libusb_get_device(cm160->devh) == device && !cm160->disconnect) {
+                log_print(LOG_INFO, "CM160: %s unplugged\n", cm160->serial);
+                cm160->disconnect = 3;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find, open and service CM160 devices until we're cancelled. Devices are
+ * found as they're plugged in with hotplug callbacks if libusb supports them
+ * here, and otherwise by scanning the bus every second.
+ */
+static void usb_loop() {
+    int r;
+    libusb_context *context = NULL;
+    libusb_hotplug_callback_handle hotplug_handle;
+    bool hotplug = false;
+    if ((r=libusb_init(&context)) < 0) {
+        log_print(LOG_ERROR, "ERROR: libusb_init returned %d\n", r);
+        active = 0;
+    } else if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        // LIBUSB_HOTPLUG_ENUMERATE reports devices already plugged in as arrivals
+        if ((r=libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE, OWL_VENDOR_ID, CM160_DEV_ID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_event, NULL, &hotplug_handle)) < 0) {
+            log_print(LOG_ERROR, "ERROR: libusb_hotplug_register_callback returned %d (%s), scanning instead\n", r, libusb_strerror(r));
+        } else {
+            hotplug = true;
+        }
+    }
+    uint64_t nextscan = hotplug ? 0 : millis();     // 0 = not until something is dropped
+    while (active) {
+        for (int i=0;i<arrivalcount;i++) {
+            device_add(arrivals[i]);
+            libusb_unref_device(arrivals[i]);
+        }
+        arrivalcount = 0;
+        if (arrivals_lost) {
+            arrivals_lost = false;
+            nextscan = millis();
+        }
+        uint64_t now = millis();
+        if (nextscan && now >= nextscan) {
+            device_scan(context);
+            nextscan = hotplug ? 0 : now + 1000;
+        }
+        // Everything else happens in the transfer and hotplug callbacks
+        int wait = init_poll();
+        now = millis();
+        if (nextscan && nextscan < now + wait) {
+            wait = nextscan > now ? nextscan - now : 0;
+        }
+        struct timeval tv = { wait / 1000, (wait % 1000) * 1000 };
+        if ((r=libusb_handle_events_timeout_completed(context, &tv, NULL)) < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+            log_print(LOG_ERROR, "ERROR: libusb_handle_events returned %d (%s)\n", r, libusb_strerror(r));
+        }
+        cm160_t *prev = NULL, *next;
+        for (cm160_t *cm160=head;cm160;cm160=next) {
+            next = cm160->next;
+            if (!cm160->disconnect || !cm160_quiesce(cm160)) {
+                prev = cm160;
+                continue;
+            }
+            if (prev) {
+                prev->next = next;
+            } else {
+                head = next;
+            }
+            int disconnect = cm160->disconnect;
+            METRIC_INC(cm160->meter->metrics.disconnects);
+            cm160_close(cm160);
+            if (disconnect != 3 && !nextscan) {
+                // Still plugged in, so there'll be no arrival - look for it again shortly
+                nextscan = millis() + 1000;
+            }
+        }
+    }
+    if (hotplug) {
+        libusb_hotplug_deregister_callback(context, hotplug_handle);
+    }
+    for (int i=0;i<arrivalcount;i++) {
+        libusb_unref_device(arrivals[i]);
+    }
+    arrivalcount = 0;
+    for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
+        cm160->disconnect = 1;
+    }
+    while (head) {
+        cm160_t *prev = NULL, *next;
+        for (cm160_t *cm160=head;cm160;cm160=next) {
+            next = cm160->next;
+            if (!cm160_quiesce(cm160)) {
+                prev = cm160;
+                continue;
+            }
+            if (prev) {
+                prev->next = next;
+            } else {
+                head = next;
+            }
+            log_print(LOG_INFO, "CM160: disconnecting\n");
+            cm160_close(cm160);
+        }
+        if (head) {
+            struct timeval tv = { 1, 0 };
+            libusb_handle_events_timeout_completed(context, &tv, NULL);
+        }
+    }
+    libusb_exit(context);
+}
+
+/**
+ * The tty backend, for a CM160 left bound to the kernel's cp210x driver and
+ * read as /dev/ttyUSB<n>. Every tty is read from one thread with epoll,
+ * which only wakes when one has data or a tty that's gone is due to be
+ * tried again.
+ */
+#define MAXTTYS 16
+static const char *ttys[MAXTTYS];
+static int ttycount;
+
+/**
+ * Set the line to BAUDRATE 8N1 raw, with no flow control and DTR and RTS
+ * raised. Returns 0 on success or -1 on failure, having printed why.
+ */
+static int tty_configure(cm160_t *cm160) {
+    struct termios2 tio;
+    if (ioctl(cm160->fd, TCGETS2, &tio) < 0) {
+        log_print(LOG_ERROR, "ERROR: %s: TCGETS2: %s\n", cm160->path, strerror(errno));
+        return -1;
+    }
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cflag = BOTHER | (BOTHER << IBSHIFT) | CS8 | CLOCAL | CREAD;
+    tio.c_ispeed = tio.c_ospeed = BAUDRATE;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (ioctl(cm160->fd, TCSETS2, &tio) < 0) {
+        log_print(LOG_ERROR, "ERROR: %s: TCSETS2: %s\n", cm160->path, strerror(errno));
+        return -1;
+    }
+    int lines = TIOCM_DTR | TIOCM_RTS;
+    ioctl(cm160->fd, TIOCMBIS, &lines);     // fails on a pty, which has no modem lines
+    return 0;
+}
+
+/**
+ * Find the serial number of the USB device behind the tty in sysfs, or
+ * use the tty's name if there isn't one (a pty, say)
+ */
+static void tty_serial(cm160_t *cm160) {
+    char path[PATH_MAX + 16], dir[PATH_MAX];
+    const char *name = cm160->path;
+    if (realpath(cm160->path, dir)) {
+        name = strrchr(dir, '/') + 1;
+    } else if (strrchr(name, '/')) {
+        name = strrchr(name, '/') + 1;
+    }
+    snprintf((char *)cm160->serial, sizeof(cm160->serial), "%s", name);
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name);
+    if (!realpath(path, dir)) {
+        return;
+    }
+    // The tty's device is a USB interface; the serial number is on its parent
+    char *c;
+    while ((c = strrchr(dir, '/')) && c != dir) {
+        snprintf(path, sizeof(path), "%s/serial", dir);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            char serial[sizeof(cm160->serial)];
+            if (fgets(serial, sizeof(serial), f) && (serial[strcspn(serial, "\n")] = 0, *serial)) {
+                strcpy((char *)cm160->serial, serial);
+            }
+            fclose(f);
+            return;
+        }
+        *c = 0;
+    }
+}
+
+/**
+ * Read what's waiting. A tty whose device has gone reads 0 bytes or fails with EIO.
+ */
+static void tty_read(cm160_t *cm160) {
+    uint32_t space = cm160->ringsize - (cm160->wpos - cm160->rpos);
+    ssize_t n = read(cm160->fd, cm160->buf + (cm160->wpos & (cm160->ringsize - 1)), space);
+    if (n > 0) {
+        cm160_read(cm160, n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        if (n == 0 || errno == EIO) {
+            log_print(LOG_INFO, "CM160: %s unplugged\n", cm160->serial);
+            cm160->disconnect = 3;
+        } else {
+            log_print(LOG_ERROR, "ERROR: %s: read: %s\n", cm160->path, strerror(errno));
+            cm160->disconnect = 1;
+        }
+    }
+}
+
+/**
+ * The reply is one byte, so it either fits in the tty's output buffer or
+ * the unit isn't reading and will ask again
+ */
+static void tty_reply(cm160_t *cm160, unsigned char send) {
+    if (write(cm160->fd, &send, 1) != 1 && errno != EAGAIN) {
+        log_print(LOG_ERROR, "ERROR: %s: write: %s\n", cm160->path, strerror(errno));
+        cm160->disconnect = 1;
+    }
+}
+
+/**
+ * Set the line again, in case something else changed it. This is done
+ * straight away, so the next good frame shows whether it worked.
+ */
+static void tty_recover(cm160_t *cm160) {
+    if (tty_configure(cm160)) {
+        cm160->disconnect = 1;
+    } else {
+        log_print(LOG_INFO, "CM160: %s line reset\n", cm160->serial);
+    }
+}
+
+static bool tty_quiesce(cm160_t *cm160) {
+    return true;        // nothing is ever in flight
+}
+
+static void tty_close(cm160_t *cm160) {
+    if (cm160->fd >= 0) {
+        close(cm160->fd);       // which takes it out of the epoll set
+    }
+}
+
+static const transport_t tty_transport = { tty_reply, tty_recover, tty_quiesce, tty_close };
+
+/**
+ * Open a tty and configure it. Returns NULL on failure, having printed why.
+ */
+static cm160_t *tty_open(const char *path) {
+    cm160_t *cm160 = cm160_new();
+    if (!cm160) {
+        return NULL;
+    }
+    cm160->initstart = millis();
+    cm160->transport = &tty_transport;
+    cm160->path = path;
+    if ((cm160->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        log_print(LOG_ERROR, "ERROR: %s: %s\n", path, strerror(errno));
+        cm160_close(cm160);
+        return NULL;
+    }
+    cm160->stagestart = millis();
+    cm160->opentime = cm160->stagestart - cm160->initstart;
+    if (tty_configure(cm160)) {
+        cm160_close(cm160);
+        return NULL;
+    }
+    ioctl(cm160->fd, TCFLSH, TCIOFLUSH);    // anything left from before is stale
+    tty_serial(cm160);
+    cm160_named(cm160);
+    cm160->state = STATE_RUNNING;
+    METRIC_INC(cm160->meter->metrics.connects);
+    log_print(LOG_INFO, "CM160: %s connected on %s in %" PRIu64 "ms (open %ums)\n", cm160->serial, path, millis() - cm160->initstart, cm160->opentime);
+    return cm160;
+}
+
+/**
+ * Read every --tty until we're cancelled. One that can't be opened, or
+ * goes away, is tried again every second.
+ */
+static void tty_loop() {
+    cm160_t *devices[MAXTTYS] = { NULL };
+    struct epoll_event events[MAXTTYS];
+    uint64_t retryat = millis();        // 0 = every tty is open
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_print(LOG_ERROR, "ERROR: epoll_create1: %s\n", strerror(errno));
+        return;
+    }
+    while (active) {
+        uint64_t now = millis();
+        if (retryat && now >= retryat) {
+            retryat = 0;
+            for (int i=0;i<ttycount;i++) {
+                if (devices[i]) {
+                    continue;
+                }
+                cm160_t *cm160 = tty_open(ttys[i]);
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cm160 };
+                if (cm160 && epoll_ctl(epfd, EPOLL_CTL_ADD, cm160->fd, &ev) < 0) {
+                    log_print(LOG_ERROR, "ERROR: epoll_ctl: %s\n", strerror(errno));
+                    cm160_close(cm160);
+                    cm160 = NULL;
+                }
+                if (!(devices[i] = cm160)) {
+                    retryat = now + 1000;
+                }
+            }
+        }
+        int wait = retryat ? (retryat > now ? retryat - now : 0) : -1;
+        int n = epoll_wait(epfd, events, MAXTTYS, wait);
+        if (n < 0 && errno != EINTR) {
+            log_print(LOG_ERROR, "ERROR: epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+        for (int i=0;i<n;i++) {
+            cm160_t *cm160 = events[i].data.ptr;
+            if (!cm160->disconnect) {
+                // A hangup is seen by reading, once what came before it has been
+                tty_read(cm160);
+            }
+        }
+        for (int i=0;i<ttycount;i++) {
+            cm160_t *cm160 = devices[i];
+            if (cm160 && cm160->disconnect) {
+                METRIC_INC(cm160->meter->metrics.disconnects);
+                cm160_close(cm160);
+                devices[i] = NULL;
+                if (!retryat) {
+                    retryat = millis() + 1000;
+                }
+            }
+        }
+    }
+    for (int i=0;i<ttycount;i++) {
+        if (devices[i]) {
+            log_print(LOG_INFO, "CM160: disconnecting\n");
+            cm160_close(devices[i]);
+        }
+    }
+    close(epfd);
+}
+
 int main(int argc, char **argv) {
-    setbuf(stdout, NULL);
+    char store_dir[200] = "", query_dir[200] = "";
+    char *query_serial = NULL;
+    time_t query_from = 0, query_to = INT32_MAX;
+    int query_group = 0;
+    char capture_path[200] = "", replay_path[200] = "";
+    char latest_shm[200] = "", latest_socket[200] = "";
+    double replay_speed = 1;
+    bool bench_mode = false, host_given = false;
+    int metrics_port = 0;
     programname = argv[0];
     strcpy(mqtt_server, "localhost");
     strcpy(mqtt_topic, "cm160");
     for (int i=1;i<argc;i++) {
         if (!strcmp("--host", argv[i]) && i + 1 < argc) {
             strncpy(mqtt_server, argv[++i], sizeof(mqtt_server));
+            host_given = true;
         } else if (!strcmp("--port", argv[i])) {
             char *c;
             int v = strtol(argv[++i], &c, 10);
@@ -313,6 +1831,24 @@ int main(int argc, char **argv) {
             strncpy(mqtt_topic, argv[++i], sizeof(mqtt_topic));
         } else if (!strcmp("--announce-topic", argv[i]) && i + 1 < argc) {
             strncpy(mqtt_announce_topic, argv[++i], sizeof(mqtt_announce_topic));
+        } else if (!strcmp("--stats-topic", argv[i]) && i + 1 < argc) {
+            strncpy(stats_topic, argv[++i], sizeof(stats_topic) - 1);
+        } else if (!strcmp("--stats-interval", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v <= 0) {
+                printf("Invalid stats interval \"%s\"\n", argv[i]);
+                usage();
+            }
+            stats_interval = v;
+        } else if (!strcmp("--metrics-port", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v <= 0 || v > 65535) {
+                printf("Invalid port \"%s\" (1..65535)\n", argv[i]);
+                usage();
+            }
+            metrics_port = v;
         } else if (!strcmp("--voltage", argv[i]) && i + 1 < argc) {
             char *c;
             int v = strtol(argv[++i], &c, 10);
@@ -321,6 +1857,128 @@ int main(int argc, char **argv) {
                 usage();
             }
             voltage = v;
+        } else if (!strcmp("--batch", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v < 0) {
+                printf("Invalid batch size \"%s\"\n", argv[i]);
+                usage();
+            }
+            batch_records = v;
+        } else if (!strcmp("--batch-bytes", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v < 1024 || v > 1<<24) {
+                printf("Invalid batch size \"%s\" (1024..16777216)\n", argv[i]);
+                usage();
+            }
+            batch_bytes = v;
+        } else if (!strcmp("--batch-ms", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v <= 0) {
+                printf("Invalid batch time \"%s\"\n", argv[i]);
+                usage();
+            }
+            batch_ms = v;
+        } else if (!strcmp("--qos", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v < 0 || v > 2) {
+                printf("Invalid QoS \"%s\" (0..2)\n", argv[i]);
+                usage();
+            }
+            mqtt_qos = v;
+        } else if (!strcmp("--spool", argv[i]) && i + 1 < argc) {
+            strncpy(spool_dir, argv[++i], sizeof(spool_dir) - 1);
+        } else if (!strcmp("--spool-max", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v < 2) {
+                printf("Invalid spool size \"%s\" (2 or more)\n", argv[i]);
+                usage();
+            }
+            spool_max = v;
+        } else if (!strcmp("--drain-rate", argv[i]) && i + 1 < argc) {
+            char *c;
+            int v = strtol(argv[++i], &c, 10);
+            if (*c || v <= 0) {
+                printf("Invalid drain rate \"%s\"\n", argv[i]);
+                usage();
+            }
+            drain_rate = v;
+        } else if (!strcmp("--format", argv[i]) && i + 1 < argc) {
+            if ((output_format = format_parse(argv[++i])) < 0) {
+                printf("Invalid format \"%s\"\n", argv[i]);
+                usage();
+            }
+        } else if (!strcmp("--store", argv[i]) && i + 1 < argc) {
+            strncpy(store_dir, argv[++i], sizeof(store_dir) - 1);
+        } else if (!strcmp("--state", argv[i]) && i + 1 < argc) {
+            strncpy(state_dir, argv[++i], sizeof(state_dir) - 1);
+        } else if (!strcmp("--sink", argv[i]) && i + 1 < argc) {
+            if (sink_parse(argv[++i])) {
+                usage();
+            }
+        } else if (!strcmp("--filter", argv[i]) && i + 1 < argc) {
+            if (filter_parse(argv[++i])) {
+                usage();
+            }
+        } else if (!strcmp("--rollup", argv[i]) && i + 1 < argc) {
+            if (rollup_parse(argv[++i])) {
+                usage();
+            }
+        } else if (!strcmp("--query", argv[i]) && i + 1 < argc) {
+            strncpy(query_dir, argv[++i], sizeof(query_dir) - 1);
+        } else if (!strcmp("--serial", argv[i]) && i + 1 < argc) {
+            query_serial = argv[++i];
+        } else if ((!strcmp("--from", argv[i]) || !strcmp("--to", argv[i])) && i + 1 < argc) {
+            time_t t = parse_time(argv[i + 1]);
+            if (t < 0) {
+                printf("Invalid time \"%s\"\n", argv[i + 1]);
+                usage();
+            }
+            if (!strcmp("--from", argv[i++])) {
+                query_from = t;
+            } else {
+                query_to = t;
+            }
+        } else if (!strcmp("--group", argv[i]) && i + 1 < argc) {
+            char *c;
+            i++;
+            if (!strcmp("minute", argv[i])) {
+                query_group = 60;
+            } else if (!strcmp("hour", argv[i])) {
+                query_group = 3600;
+            } else if (!strcmp("day", argv[i])) {
+                query_group = 86400;
+            } else if ((query_group = strtol(argv[i], &c, 10)) <= 0 || *c) {
+                printf("Invalid group \"%s\"\n", argv[i]);
+                usage();
+            }
+        } else if (!strcmp("--latest-shm", argv[i]) && i + 1 < argc) {
+            strncpy(latest_shm, argv[++i], sizeof(latest_shm) - 1);
+        } else if (!strcmp("--latest-socket", argv[i]) && i + 1 < argc) {
+            strncpy(latest_socket, argv[++i], sizeof(latest_socket) - 1);
+        } else if (!strcmp("--tty", argv[i]) && i + 1 < argc) {
+            if (ttycount == MAXTTYS) {
+                printf("Too many ttys, the most is %d\n", MAXTTYS);
+                usage();
+            }
+            ttys[ttycount++] = argv[++i];
+        } else if (!strcmp("--capture", argv[i]) && i + 1 < argc) {
+            strncpy(capture_path, argv[++i], sizeof(capture_path) - 1);
+        } else if (!strcmp("--replay", argv[i]) && i + 1 < argc) {
+            strncpy(replay_path, argv[++i], sizeof(replay_path) - 1);
+        } else if (!strcmp("--replay-speed", argv[i]) && i + 1 < argc) {
+            char *c;
+            replay_speed = strtod(argv[++i], &c);
+            if (*c || replay_speed < 0) {
+                printf("Invalid replay speed \"%s\"\n", argv[i]);
+                usage();
+            }
+        } else if (!strcmp("--bench", argv[i])) {
+            bench_mode = true;
         } else if (!strcmp("--debug", argv[i])) {
             debug = 1;
         } else if (!strcmp("--all", argv[i])) {
@@ -329,198 +1987,78 @@ int main(int argc, char **argv) {
             usage();
         }
     }
+    if (strlen(spool_dir) && batch_bytes > SPOOL_MESSAGE_MAX) {
+        printf("Batch size %d is too big for --spool (at most %d)\n", batch_bytes, SPOOL_MESSAGE_MAX);
+        usage();
+    }
 
-    char buf[200];
-    gethostname(hostname, 100);
-    int keepalive = 60;
-    bool clean_session = true;
-    mosquitto_lib_init();
-    mosq = mosquitto_new(NULL, clean_session, NULL);
-    if (!mosq) {
-        perror("ERROR: Mosquitto init failed");
-        exit(-1);
+    if (strlen(query_dir)) {
+        return store_query(query_dir, query_serial, query_from, query_to, query_group, voltage) ? -1 : 0;
     }
-//    mosquitto_log_callback_set(mosq, mqttLog);
-//    mosquitto_disconnect_callback_set(mosq, mqttDisconnect);
-    mosquitto_connect_callback_set(mosq, mqttConnect);
-    if (strlen(mqtt_announce_topic)) {
-        char buf[180];
-        sprintf(buf, "{\"type\":\"announce\",\"connect\":false,\"who\":\"%s\",\"where\":\"%s\"}", argv[0], hostname);
-        mosquitto_will_set(mosq, mqtt_announce_topic, strlen(buf), buf, 0, false);
+    if (!bench_mode) {
+        log_start();
+    }
+    if (strlen(store_dir) && !(store = store_open(store_dir))) {
+        exit(-1);
     }
-    if (mosquitto_connect(mosq, mqtt_server, mqtt_port, keepalive)) {
-        perror("ERROR: Mosquitto connect failed");
+    if (strlen(spool_dir) && !(spool = spool_open(spool_dir, (size_t)spool_max * 1024 * 1024))) {
         exit(-1);
     }
-    if (mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
-        perror("ERROR: Mosquitto loop failed");
+    if (mqtt_qos < 0) {
+        mqtt_qos = spool ? 1 : 0;
+    }
+
+    gethostname(hostname, 100);
+    if (strlen(capture_path) && !(capture = fopen(capture_path, "w"))) {
+        log_print(LOG_ERROR, "ERROR: capture: %s\n", strerror(errno));
         exit(-1);
     }
-    if (strlen(mqtt_announce_topic)) {
-        sprintf(buf, "{\"type\":\"announce\",\"connect\":true,\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\"}", millis()/1000, argv[0], hostname);
-        mosquitto_publish(mosq, NULL, mqtt_announce_topic, strlen(buf), buf, 0, 0);
+    if (!bench_mode && (!strlen(replay_path) || host_given)) {
+        mqtt_start();
     }
     signal(SIGINT, cancel);
     signal(SIGTERM, cancel);
-
-    libusb_context *context = NULL;
-    libusb_device **list = NULL;
-    static struct libusb_device_descriptor desc;
-    int r;
-    if ((r=libusb_init(&context)) < 0) {
-        printf("ERROR: libusb_init returned %d\n", r);
-        active = 0;
+    if (metrics_port && metrics_start(metrics_port)) {
+        exit(-1);
     }
-    bool scanning = true;
-    while (active) {
-        if (scanning) {
-            r = libusb_get_device_list(context, &list);
-            if (r < 0) {
-                printf("ERROR: libusb_get_device_list returned %d\n", r);
-                active = 0;
-            }
-            int count = r;
-            for (int i = 0;i<count;i++) {
-                libusb_device *device = list[i];
-                int seen = 0;
-                for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
-                    if (libusb_get_device(cm160->devh) == device) {
-                        seen = 1;
-                        break;
-                    }
-                }
-                if (!seen) {
-                    if ((r=libusb_get_device_descriptor(device, &desc)) < 0) {
-                        printf("ERROR: libusb_get_device_descriptor returned %d (%s)\n", r, libusb_strerror(r));
-                    } else if (desc.idVendor == OWL_VENDOR_ID && desc.idProduct == CM160_DEV_ID) {
-                        cm160_t *cm160 = calloc(sizeof(struct cm160_struct), 1);
-                        if (head) {
-                            cm160->next = head;
-                        }
-                        if ((r=libusb_open(device, &(cm160->devh))) < 0) {
-                            printf("ERROR: libusb_open returned %d (%s)\n", r, libusb_strerror(r));
-                            free(cm160);
-                            continue;
-                        }
-                        if ((r=libusb_get_string_descriptor_ascii(cm160->devh, desc.iSerialNumber, cm160->serial, sizeof(cm160->serial))) < 0) {
-                            printf("ERROR: libusb_get_string_descriptor_ascii returned %d (%s)\n", r, libusb_strerror(r));
-                        }
-                        if (libusb_kernel_driver_active(cm160->devh, USB_INTERFACE)) {
-                            if (libusb_detach_kernel_driver(cm160->devh, 0)) {
-                                printf("ERROR: libusb_detach_kernel_driver failed\n");
-                            }
-                            cm160->kernel = 1;
-                        }
-                        libusb_set_auto_detach_kernel_driver(cm160->devh, 1);
-                        if ((r = libusb_set_configuration(cm160->devh, USB_CONFIGURATION))) {
-                            printf("ERROR: libusb_set_configuration returned %d (%s)\n", r, libusb_strerror(r));
-                        }
-                        sleep(1);
-                        if ((r = libusb_claim_interface(cm160->devh, USB_INTERFACE))) {
-                            printf("ERROR: libusb_claim_interface returned %d (%s)\n", r, libusb_strerror(r));
-                            libusb_close(cm160->devh);
-                            free(cm160);
-                            continue;
-                        }
-                        printf("CM160: connected\n");
-                         // set baudrate
-                        int baudrate = 250000;
-                        // See https://www.silabs.com/documents/public/application-notes/AN571.pdf
-                        if ((r=libusb_control_transfer(cm160->devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, CP210X_IFC_ENABLE, UART_ENABLE, USB_INTERFACE, NULL, 0, 500)) < 0) {
-                            printf("ERROR: libusb_control_transfer (CP210X_IFC_ENABLE on) returned %d (%s)\n", r, libusb_strerror(r));
-                        }
-                        if ((r=libusb_control_transfer(cm160->devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, CP210X_SET_BAUDRATE, 0, USB_INTERFACE, (void *)&baudrate, sizeof(baudrate), 500)) < 0) {
-                            printf("ERROR: libusb_control_transfer (CP210X_SET_BAUDRATE) returned %d (%s)\n", r, libusb_strerror(r));
-                        }
-//                        if ((r=libusb_control_transfer(cm160->devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, CP210X_SET_LINE_CTL, 0x0800, USB_INTERFACE, NULL, 0, 500)) < 0) {
-//                            printf("ERROR: libusb_control_transfer (CP210X_SET_LINE_CTL) returned %d (%s)\n", r, libusb_strerror(r));
-//                        }
-                        if ((r=libusb_control_transfer(cm160->devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT, CP210X_IFC_ENABLE, UART_DISABLE, USB_INTERFACE, NULL, 0, 500)) < 0) {
-                            printf("ERROR: libusb_control_transfer (CP210X_IFC_ENABLE off) returned %d (%s)\n", r, libusb_strerror(r));
-                        }
-                        head = cm160;
-                    }
-                }
-            }
-            scanning = false;
-        }
-        for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
-            int n = 0;
-            int disconnect = 0;
-            if ((r = libusb_bulk_transfer(cm160->devh, BULK_ENDPOINT_IN, cm160->buf + cm160->buflen, sizeof(cm160->buf) - cm160->buflen, &n, 20000)) < 0) {
-                printf("ERROR: libusb_bulk_transfer returned %d (%s)\n", r, libusb_strerror(r));
-                disconnect = 1;
-            }
-            if (n >= 0) {
-                cm160->buflen += n;
-                // printf("read %d now %d\n", n, cm160->buflen);
-                while (cm160->buflen >= FRAME_SIZE) {
-                    r = process_frame(cm160);
-                    if (r == 0) {
-                        // We couldn't read anything - try advancing one byte
-                        r = 1;
-                    }
-                    cm160->buflen -= r;
-                    memmove(cm160->buf, cm160->buf + r, cm160->buflen);
-                }
-            }
-            if (cm160->idcount == MAXIDCOUNT) {
-                // Seems to get stuck. Disconnect, reconnect.
-                // It's not hearing our replies - "ID Frame" means
-                // "I haven't heard from the server for a while"
-                disconnect = 2;
-                printf("ERROR: stuck in ID frame loop, reconnecting\n");
-            }
-            if (disconnect) {
-                libusb_release_interface(cm160->devh, USB_INTERFACE);
-                if (cm160->kernel) {
-                    libusb_attach_kernel_driver(cm160->devh, USB_INTERFACE);
-                }
-                libusb_close(cm160->devh);
-                if (head == cm160) {
-                    head = cm160->next;
-                } else {
-                    for (cm160_t *t=head;t;t=t->next) {
-                        if (t->next == cm160) {
-                            t->next = cm160->next;
-                            break;
-                        }
-                    }
-                }
-                if (disconnect == 2) {
-                    // Something like this seems to be needed. 
-                    // stty -F /dev/ttyUSB0 ospeed 250000 ispeed 250000 cs8 raw
-                    int fd = open("/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_SYNC);
-                    if (fd < 0) {
-                        perror("open");
-                    } else {
-                        struct termios tty;
-                        cfmakeraw(&tty);
-                        if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-                            perror("tcsetattr");
-                        }
-                        close(fd);
-                    }
-                }
-            }
-        }
-        if (!head) {
-            scanning = true;
-            sleep(1);
-        }
+    if (!bench_mode && sink_start()) {
+        exit(-1);
     }
-    for (cm160_t *cm160=head;cm160;cm160=cm160->next) {
-        printf("CM160: disconnecting\n");
-        libusb_release_interface(cm160->devh, USB_INTERFACE);
-        if (cm160->kernel) {
-            libusb_attach_kernel_driver(cm160->devh, USB_INTERFACE);
+    if (!bench_mode && latest_start(latest_shm, latest_socket)) {
+        exit(-1);
+    }
+
+    if (bench_mode) {
+        bench(replay_path);
+    } else if (strlen(replay_path)) {
+        publisher_block = true;     // a replay can wait for the publisher, and shouldn't lose readings
+        publisher_start();
+        replay(replay_path, replay_speed);
+    } else {
+        publisher_start();
+        if (ttycount) {
+            tty_loop();
+        } else {
+            usb_loop();
         }
-        libusb_close(cm160->devh);
     }
-    libusb_exit(context);
+    publisher_stop();
+    sink_stop();
+    latest_stop();
+    metrics_stop();
+    if (capture) {
+        fclose(capture);
+    }
+    if (spool) {
+        spool_close(spool);
+    }
+    if (store) {
+        store_close(store);
+    }
     if (mosq) {
         mosquitto_destroy(mosq);
+        mosquitto_lib_cleanup();
     }
-    mosquitto_lib_cleanup();
+    log_stop();
     return 0;
 }
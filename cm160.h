@@ -0,0 +1,53 @@
+/*
+ * Settings and state shared between the reader (cm160.c) and the
+ * publisher (publish.c)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#ifndef CM160_H
+#define CM160_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "spool.h"
+#include "store.h"
+#include "format.h"
+
+extern struct mosquitto *mosq;
+extern int mqtt_port;
+extern char mqtt_server[100];
+extern char mqtt_topic[100];
+extern char mqtt_announce_topic[100];
+extern char hostname[100];
+extern char *programname;
+extern int voltage;
+extern int debug, all;
+extern int batch_records, batch_bytes, batch_ms;
+extern int mqtt_qos;
+extern spool_t *spool;
+extern int drain_rate;
+extern store_t *store;
+extern int quiet;
+extern int output_format;
+extern char stats_topic[100];
+extern int stats_interval;
+extern char state_dir[200];
+
+/**
+ * Return the time in milliseconds since 1970
+ */
+uint64_t millis();
+
+/**
+ * Start a thread running "run" with "arg", with SIGINT and SIGTERM blocked
+ * in it. Returns 0 or the error from pthread_create().
+ */
+int thread_start(pthread_t *thread, void *(*run)(void *), void *arg);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Serialising readings for publication - see format.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "format.h"
+
+#define BINARY_SIZE     48
+
+static const char *names[] = { "json", "cbor", "influx", "binary" };
+
+static const char digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int format_parse(const char *name) {
+    for (int i=0;i<(int)(sizeof(names)/sizeof(names[0]));i++) {
+        if (!strcmp(name, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool format_text(int type) {
+    return type == FORMAT_JSON || type == FORMAT_INFLUX;
+}
+
+static char *put(char *p, const void *s, int len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *put_u64(char *p, uint64_t v) {
+    char tmp[20], *t = tmp + sizeof(tmp);
+    while (v >= 100) {
+        const char *d = digits + (v % 100) * 2;
+        v /= 100;
+        *--t = d[1];
+        *--t = d[0];
+    }
+    if (v >= 10) {
+        *--t = digits[v * 2 + 1];
+        *--t = digits[v * 2];
+    } else {
+        *--t = '0' + v;
+    }
+    return put(p, t, tmp + sizeof(tmp) - t);
+}
+
+static char *put_i64(char *p, int64_t v) {
+    if (v < 0) {
+        *p++ = '-';
+        return put_u64(p, -(uint64_t)v);
+    }
+    return put_u64(p, v);
+}
+
+// amps to two decimal places, from the raw value
+static char *put_amps(char *p, uint16_t amps) {
+    uint32_t v = reading_centiamps(amps);
+    p = put_u64(p, v / 100);
+    *p++ = '.';
+    return put(p, digits + (v % 100) * 2, 2);
+}
+
+// Append a template string, escaping it for JSON or as an InfluxDB tag value
+static char *put_escaped(char *p, char *end, const char *s, int type) {
+    for (;*s && p < end - 2;s++) {
+        if (type == FORMAT_JSON ? (*s == '"' || *s == '\\') : (*s == ',' || *s == ' ' || *s == '=')) {
+            *p++ = '\\';
+        }
+        *p++ = *s;
+    }
+    return p;
+}
+
+static char *cbor_head(char *p, int major, uint64_t v) {
+    major <<= 5;
+    if (v < 24) {
+        *p++ = major | v;
+    } else if (v <= 0xFF) {
+        *p++ = major | 24;
+        *p++ = v;
+    } else if (v <= 0xFFFF) {
+        *p++ = major | 25;
+        *p++ = v >> 8;
+        *p++ = v;
+    } else if (v <= 0xFFFFFFFF) {
+        *p++ = major | 26;
+        for (int i=24;i>=0;i-=8) {
+            *p++ = v >> i;
+        }
+    } else {
+        *p++ = major | 27;
+        for (int i=56;i>=0;i-=8) {
+            *p++ = v >> i;
+        }
+    }
+    return p;
+}
+
+static char *cbor_int(char *p, int64_t v) {
+    return v < 0 ? cbor_head(p, 1, -1 - v) : cbor_head(p, 0, v);
+}
+
+static char *cbor_text(char *p, char *end, const char *s) {
+    int len = strlen(s);
+    if (len > end - p - 9) {
+        len = end - p - 9;
+    }
+    p = cbor_head(p, 3, len);
+    return put(p, s, len);
+}
+
+static char *le(char *p, uint64_t v, int len) {
+    for (int i=0;i<len;i++) {
+        *p++ = v >> (i * 8);
+    }
+    return p;
+}
+
+void format_init(format_t *format, int type, const char *serial, const char *who, const char *where, int voltage) {
+    char *p = format->head, *end = format->head + sizeof(format->head);
+    char *q = format->tail, *qend = format->tail + sizeof(format->tail);
+    format->type = type;
+    format->voltage = voltage;
+    switch (type) {
+        case FORMAT_JSON:
+            p = put(p, "{\"type\":\"cm160\",\"serial\":\"", 26);
+            p = put_escaped(p, end - 10, serial, type);
+            p = put(p, "\",\"amps\":", 9);
+            q = put(q, ",\"who\":\"", 8);
+            q = put_escaped(q, qend - 16, who, type);
+            q = put(q, "\",\"where\":\"", 11);
+            q = put_escaped(q, qend - 3, where, type);
+            q = put(q, "\"}", 2);
+            break;
+        case FORMAT_CBOR:
+            *p++ = 0xBF;                                    // indefinite-length map
+            p = cbor_text(p, end, "type");
+            p = cbor_text(p, end, "cm160");
+            p = cbor_text(p, end, "serial");
+            p = cbor_text(p, end - 8, serial);
+            p = cbor_text(p, end, "amps");
+            q = cbor_text(q, qend, "who");
+            q = cbor_text(q, qend - 16, who);
+            q = cbor_text(q, qend, "where");
+            q = cbor_text(q, qend - 1, where);
+            *q++ = 0xFF;                                    // break
+            break;
+        case FORMAT_INFLUX:
+            p = put(p, "cm160,serial=", 13);
+            p = put_escaped(p, end - 40, serial, type);
+            p = put(p, ",where=", 7);
+            p = put_escaped(p, end - 25, where, type);
+            p = put(p, ",who=", 5);
+            p = put_escaped(p, end - 6, who, type);
+            p = put(p, " amps=", 6);
+            break;
+        case FORMAT_BINARY:
+            memset(p, 0, BINARY_SIZE);
+            le(p, 0xC160, 2);
+            p[2] = 1;
+            le(p + 6, voltage, 2);
+            strncpy(p + 32, serial, 16);
+            p += BINARY_SIZE;
+            break;
+    }
+    format->headlen = p - format->head;
+    format->taillen = q - format->tail;
+}
+
+int format_reading(const format_t *format, const reading_t *reading, char *buf) {
+    char *p = put(buf, format->head, format->headlen);
+    switch (format->type) {
+        case FORMAT_JSON:
+            p = put_amps(p, reading->amps);
+            p = put(p, ",\"watts\":", 9);
+            p = put_i64(p, reading->watts);
+            p = put(p, ",\"unitwhen\":", 12);
+            p = put_i64(p, reading->unitwhen);
+            if (reading->more) {
+                p = put(p, ",\"more\":true", 12);
+            }
+            if (reading->old) {
+                p = put(p, ",\"old\":true", 11);
+            }
+            p = put(p, ",\"when\":", 8);
+            p = put_u64(p, reading->when);
+            break;
+        case FORMAT_CBOR: {
+            double amps = reading_centiamps(reading->amps) / 100.0;
+            uint64_t bits;
+            memcpy(&bits, &amps, sizeof(bits));
+            *p++ = 0xFB;                                    // double, big-endian
+            for (int i=56;i>=0;i-=8) {
+                *p++ = bits >> i;
+            }
+            p = put(p, "\x65watts", 6);
+            p = cbor_int(p, reading->watts);
+            p = put(p, "\x68unitwhen", 9);
+            p = cbor_int(p, reading->unitwhen);
+            if (reading->more) {
+                p = put(p, "\x64more\xF5", 6);
+            }
+            if (reading->old) {
+                p = put(p, "\x63old\xF5", 5);
+            }
+            p = put(p, "\x64when", 5);
+            p = cbor_int(p, reading->when);
+            break;
+        }
+        case FORMAT_INFLUX:
+            p = put_amps(p, reading->amps);
+            p = put(p, ",watts=", 7);
+            p = put_i64(p, reading->watts);
+            p = put(p, "i,when=", 7);
+            p = put_u64(p, reading->when);
+            *p++ = 'i';
+            if (reading->more) {
+                p = put(p, ",more=true", 10);
+            }
+            if (reading->old) {
+                p = put(p, ",old=true", 9);
+            }
+            *p++ = ' ';
+            p = put_i64(p, reading->unitwhen);
+            p = put(p, "000000000", 9);                     // nanoseconds
+            break;
+        case FORMAT_BINARY:
+            buf[3] = (reading->more ? 1 : 0) | (reading->old ? 2 : 0);
+            le(buf + 4, reading->amps, 2);
+            le(buf + 8, (uint32_t)reading->watts, 4);
+            le(buf + 16, (uint64_t)reading->unitwhen, 8);
+            le(buf + 24, reading->when, 8);
+            break;
+    }
+    p = put(p, format->tail, format->taillen);
+    return p - buf;
+}
+
+const char *format_batch_open(int type, int *len) {
+    *len = type == FORMAT_JSON || type == FORMAT_CBOR;
+    return type == FORMAT_JSON ? "[" : "\x9F";          // indefinite-length array
+}
+
+const char *format_batch_separator(int type, int *len) {
+    *len = type == FORMAT_JSON || type == FORMAT_INFLUX;
+    return type == FORMAT_JSON ? "," : "\n";
+}
+
+const char *format_batch_close(int type, int *len) {
+    *len = type == FORMAT_JSON || type == FORMAT_CBOR;
+    return type == FORMAT_JSON ? "]" : "\xFF";          // break
+}
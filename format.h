@@ -0,0 +1,88 @@
+/*
+ * Serialising readings for publication
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Everything in a message that doesn't change between readings from one
+ * device - the serial number, program name and host - is rendered once into
+ * a template when the device connects. Serialising a reading then copies the
+ * template pieces and writes the few numbers that do change, with integer
+ * arithmetic throughout.
+ *
+ * The formats are
+ *
+ *   json     {"type":"cm160","serial":"...","amps":1.23,"watts":283,"unitwhen":...,
+ *             "more":true,"old":true,"when":...,"who":"...","where":"..."}
+ *            ("more" and "old" only when true). This is the default.
+ *   cbor     the same fields as a CBOR map (RFC 8949), amps as a double
+ *   influx   InfluxDB line protocol: measurement "cm160", tags serial, who and
+ *            where, fields amps, watts, when, more and old, timestamped with
+ *            unitwhen in nanoseconds
+ *   binary   a packed 48-byte little-endian record:
+ *              0  u16  0xC160
+ *              2  u8   version, 1
+ *              3  u8   flags: 1 = more, 2 = old
+ *              4  u16  raw amps (x 0.07 for amps)
+ *              6  u16  voltage
+ *              8  i32  watts
+ *             12  u32  reserved, 0
+ *             16  i64  unitwhen
+ *             24  u64  when
+ *             32  char serial, NUL-padded to 16 bytes
+ *
+ * Batches of readings are a JSON array, an indefinite-length CBOR array,
+ * newline-separated lines or concatenated records respectively.
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include "reading.h"
+
+#define FORMAT_JSON     0
+#define FORMAT_CBOR     1
+#define FORMAT_INFLUX   2
+#define FORMAT_BINARY   3
+
+#define FORMAT_MAX      512     // the most bytes a serialised reading can take
+
+typedef struct {
+    int type;
+    int voltage;
+    uint16_t headlen, taillen;
+    char head[200];             // everything before the first variable field
+    char tail[200];             // everything after the last
+} format_t;
+
+/**
+ * Return the format called "name", or -1 if there isn't one
+ */
+int format_parse(const char *name);
+
+/**
+ * Return true if the format is text, and so can be logged as it is
+ */
+bool format_text(int type);
+
+/**
+ * Build the template for a device
+ */
+void format_init(format_t *format, int type, const char *serial, const char *who, const char *where, int voltage);
+
+/**
+ * Serialise a reading into buf, which must hold FORMAT_MAX bytes, returning its length
+ */
+int format_reading(const format_t *format, const reading_t *reading, char *buf);
+
+/**
+ * Return the bytes that open a batch, separate the readings in it and close
+ * it, each at most 1 byte long; "len" is set to the length.
+ */
+const char *format_batch_open(int type, int *len);
+const char *format_batch_separator(int type, int *len);
+const char *format_batch_close(int type, int *len);
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * The latest reading from each device, for local readers - see latest.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cm160.h"
+#include "latest.h"
+#include "metrics.h"
+#include "log.h"
+
+#define MAXCLIENTS      16          // connected to the socket at once
+#define REQUEST_MAX     128         // the longest request line
+
+static latest_file_t *file;
+static bool shared;                 // file is the shm segment, rather than our own memory
+static int server_fd = -1;
+static char server_path[108];
+static pthread_t server;
+static volatile bool serving;
+
+static struct {
+    int fd;                         // -1 for none
+    int len;
+    char buf[REQUEST_MAX];
+} clients[MAXCLIENTS];
+
+latest_device_t *latest_device(const char *serial) {
+    if (!file) {
+        return NULL;
+    }
+    for (uint32_t i=0;i<file->devices;i++) {
+        if (!strcmp(file->device[i].serial, serial)) {
+            return &file->device[i];
+        }
+    }
+    if (file->devices == LATEST_DEVICES) {
+        log_print(LOG_ERROR, "ERROR: latest: no slot for %s, the most is %d\n", serial, LATEST_DEVICES);
+        return NULL;
+    }
+    latest_device_t *device = &file->device[file->devices];
+    uint32_t seq = device->seq;
+    __atomic_store_n(&device->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset((char *)device + sizeof(device->seq), 0, sizeof(latest_device_t) - sizeof(device->seq));
+    strncpy(device->serial, serial, sizeof(device->serial) - 1);
+    __atomic_store_n(&device->seq, seq + 2, __ATOMIC_RELEASE);
+    // Readers only look at slots below "devices", so it must be complete first
+    __atomic_store_n(&file->devices, file->devices + 1, __ATOMIC_RELEASE);
+    return device;
+}
+
+void latest_update(latest_device_t *device, const reading_t *reading) {
+    int64_t minute = reading->unitwhen / 60;
+    latest_minute_t *m = &device->minute[minute & (LATEST_MINUTES - 1)];
+    bool live = !reading->old;
+    if (!live && minute < m->minute) {
+        return;         // history older than what we have
+    }
+    uint32_t seq = device->seq;
+    __atomic_store_n(&device->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (minute >= m->minute) {
+        m->minute = minute;
+        m->amps = reading->amps;
+        m->watts = reading->watts;
+    }
+    if (live) {
+        device->unitwhen = reading->unitwhen;
+        device->when = reading->when;
+        device->readtime = reading->readtime;
+        device->amps = reading->amps;
+        device->watts = reading->watts;
+        device->readings++;
+    }
+    __atomic_store_n(&device->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write the JSON for a device to "f"
+ */
+static void device_json(FILE *f, const latest_device_t *device, uint64_t now) {
+    uint32_t ca = reading_centiamps(device->amps);
+    fprintf(f, "{\"serial\":\"%s\",\"amps\":%u.%02u,\"watts\":%d,\"unitwhen\":%" PRId64 ",\"when\":%" PRIu64 ",\"age_ms\":%" PRIu64 ",\"minutes\":[", device->serial, ca / 100, ca % 100, device->watts, device->unitwhen, device->when, device->readtime && now > device->readtime ? (now - device->readtime) / 1000 : 0);
+    // Oldest first: the slots after the newest minute, wrapping round to it
+    int64_t newest = 0;
+    for (int i=0;i<LATEST_MINUTES;i++) {
+        if (device->minute[i].minute > newest) {
+            newest = device->minute[i].minute;
+        }
+    }
+    bool first = true;
+    for (int64_t minute=newest-LATEST_MINUTES+1;minute<=newest;minute++) {
+        const latest_minute_t *m = &device->minute[minute & (LATEST_MINUTES - 1)];
+        if (newest && m->minute == minute) {
+            fprintf(f, "%s[%" PRId64 ",%d]", first ? "" : ",", minute * 60, m->watts);
+            first = false;
+        }
+    }
+    fprintf(f, "]}");
+}
+
+/**
+ * Answer a request for "serial", or every device if it's empty
+ */
+static void answer(int i, const char *serial) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    uint64_t now = monotonic_us();
+    bool first = true;
+    fputc('[', f);
+    uint32_t devices = __atomic_load_n(&file->devices, __ATOMIC_ACQUIRE);
+    for (uint32_t d=0;d<devices;d++) {
+        latest_device_t device;
+        if (latest_read(file, d, &device) && (!*serial || !strcmp(device.serial, serial))) {
+            fprintf(f, "%s", first ? "" : ",");
+            device_json(f, &device, now);
+            first = false;
+        }
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+    // A client that can't take a whole reply isn't reading them, so it goes
+    if (send(clients[i].fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len) {
+        close(clients[i].fd);
+        clients[i].fd = -1;
+    }
+    free(buf);
+}
+
+/**
+ * Read what a client has sent and answer every whole line
+ */
+static void client_read(int i) {
+    ssize_t r = read(clients[i].fd, clients[i].buf + clients[i].len, REQUEST_MAX - clients[i].len);
+    if (r <= 0) {
+        if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close(clients[i].fd);
+            clients[i].fd = -1;
+        }
+        return;
+    }
+    clients[i].len += r;
+    char *line = clients[i].buf, *nl;
+    while (clients[i].fd >= 0 && (nl = memchr(line, '\n', clients[i].buf + clients[i].len - line))) {
+        *nl = 0;
+        if (nl > line && nl[-1] == '\r') {
+            nl[-1] = 0;
+        }
+        answer(i, line);
+        line = nl + 1;
+    }
+    if (clients[i].fd < 0) {
+        return;
+    }
+    clients[i].len -= line - clients[i].buf;
+    memmove(clients[i].buf, line, clients[i].len);
+    if (clients[i].len == REQUEST_MAX) {
+        close(clients[i].fd);       // no request is this long
+        clients[i].fd = -1;
+    }
+}
+
+static void *server_run(void *arg) {
+    struct pollfd p[MAXCLIENTS + 1];
+    while (serving) {
+        int n = 0;
+        p[n++] = (struct pollfd) { server_fd, POLLIN, 0 };
+        for (int i=0;i<MAXCLIENTS;i++) {
+            if (clients[i].fd >= 0) {
+                p[n++] = (struct pollfd) { clients[i].fd, POLLIN, 0 };
+            }
+        }
+        if (poll(p, n, 1000) <= 0) {
+            continue;
+        }
+        for (int i=0;i<MAXCLIENTS;i++) {
+            for (int j=1;j<n;j++) {
+                if (clients[i].fd == p[j].fd && p[j].revents) {
+                    client_read(i);
+                    break;
+                }
+            }
+        }
+        if (p[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                int i = 0;
+                while (i < MAXCLIENTS && clients[i].fd >= 0) {
+                    i++;
+                }
+                if (i == MAXCLIENTS) {
+                    log_print(LOG_ERROR, "ERROR: latest: too many clients\n");
+                    close(fd);
+                } else {
+                    clients[i].fd = fd;
+                    clients[i].len = 0;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+int latest_start(const char *shm, const char *socket_path) {
+    if (strlen(shm)) {
+        char name[200];
+        snprintf(name, sizeof(name), "/%s", shm);
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(latest_file_t)) < 0 || (file = mmap(NULL, sizeof(latest_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            log_print(LOG_ERROR, "ERROR: latest: shm \"%s\": %s\n", shm, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            file = NULL;
+            return -1;
+        }
+        close(fd);
+        shared = true;
+    } else if (strlen(socket_path)) {
+        file = calloc(sizeof(latest_file_t), 1);
+    } else {
+        return 0;
+    }
+    if (file->magic != LATEST_MAGIC || file->version != LATEST_VERSION || file->size != sizeof(latest_file_t)) {
+        // Left by something else, or nothing: start again
+        file->devices = 0;
+        for (int i=0;i<LATEST_DEVICES;i++) {
+            uint32_t seq = file->device[i].seq & ~1;
+            memset(&file->device[i], 0, sizeof(latest_device_t));
+            file->device[i].seq = seq + 2;
+        }
+        file->size = sizeof(latest_file_t);
+        file->version = LATEST_VERSION;
+        __atomic_store_n(&file->magic, LATEST_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        // Ours from an earlier run, which may have died part way through
+        // writing a slot: make "seq" even again so readers can have it
+        for (int i=0;i<LATEST_DEVICES;i++) {
+            uint32_t seq = file->device[i].seq;
+            __atomic_store_n(&file->device[i].seq, (seq + 1) & ~1, __ATOMIC_RELEASE);
+        }
+    }
+    if (!strlen(socket_path)) {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        log_print(LOG_ERROR, "ERROR: latest: socket path \"%s\" is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    strcpy(server_path, socket_path);
+    unlink(socket_path);
+    if ((server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 || bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_fd, 8) < 0) {
+        log_print(LOG_ERROR, "ERROR: latest: %s: %s\n", socket_path, strerror(errno));
+        if (server_fd >= 0) {
+            close(server_fd);
+            server_fd = -1;
+        }
+        return -1;
+    }
+    for (int i=0;i<MAXCLIENTS;i++) {
+        clients[i].fd = -1;
+    }
+    int r;
+    serving = true;
+    if ((r=thread_start(&server, server_run, NULL))) {
+        log_print(LOG_ERROR, "ERROR: pthread_create returned %d (%s)\n", r, strerror(r));
+        serving = false;
+    }
+    return serving ? 0 : -1;
+}
+
+void latest_stop() {
+    if (serving) {
+        serving = false;
+        pthread_join(server, NULL);
+    }
+    if (server_fd >= 0) {
+        close(server_fd);
+        server_fd = -1;
+        unlink(server_path);
+        for (int i=0;i<MAXCLIENTS;i++) {
+            if (clients[i].fd >= 0) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+    }
+    if (file) {
+        if (shared) {
+            munmap(file, sizeof(latest_file_t));
+        } else {
+            free(file);
+        }
+        file = NULL;
+    }
+}
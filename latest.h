@@ -0,0 +1,121 @@
+/*
+ * The latest reading from each device, for local readers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * A program on the same host that only wants the current watts needn't go
+ * through the broker. The reader thread writes each reading, as it's
+ * decoded, into a slot for its device, along with the last LATEST_MINUTES
+ * minutes of readings (live or history). There are two ways to get at it:
+ *
+ *   --latest-shm <name>        the slots are a POSIX shared memory segment,
+ *                              /dev/shm/<name>, laid out as latest_file_t.
+ *                              Map it read-only and use latest_read().
+ *   --latest-socket <path>     a unix stream socket. Send a serial number,
+ *                              or an empty line for every device, followed
+ *                              by a newline; the reply is one line, a JSON
+ *                              array with an object for each device:
+ *
+ *     {"serial":"...","amps":4.90,"watts":1127,"unitwhen":...,"when":...,
+ *      "age_ms":...,"minutes":[[<unitwhen>,<watts>],...]}
+ *
+ *                              with the minutes oldest first. Any number
+ *                              of requests can be sent on a connection.
+ *
+ * Each slot is guarded by a seqlock: the writer makes "seq" odd, changes
+ * the slot, then makes it even again, and a reader copies the slot and
+ * tries again if "seq" was odd or changed meanwhile. So the writer never
+ * waits for a reader and a reader never takes a lock - a read is a copy
+ * of about a kilobyte.
+ *
+ * The segment is left in place when we exit, so a reader's mapping stays
+ * good across a restart; a device keeps its slot, and "readtime" shows how
+ * fresh a reading is.
+ */
+
+#ifndef LATEST_H
+#define LATEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "reading.h"
+
+#define LATEST_MAGIC    0x5453414c      // "LAST"
+#define LATEST_VERSION  1
+#define LATEST_DEVICES  16
+#define LATEST_MINUTES  64              // a power of two
+
+typedef struct {
+    int64_t minute;             // unitwhen / 60, or 0 if empty
+    uint16_t amps;              // as reported, x 0.07 for amps
+    int32_t watts;
+} latest_minute_t;
+
+typedef struct {
+    uint32_t seq;               // odd while the rest is being written
+    char serial[80];
+    int64_t unitwhen;           // the newest live reading: the minute it's for, by the unit's clock
+    uint64_t when;              // ... seconds since 1970 when it was received
+    uint64_t readtime;          // ... CLOCK_MONOTONIC microseconds when it was read
+    uint16_t amps;              // ... as reported, x 0.07 for amps
+    int32_t watts;
+    uint64_t readings;          // live readings since the slot was made
+    latest_minute_t minute[LATEST_MINUTES];     // indexed by minute modulo LATEST_MINUTES
+} latest_device_t;
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t size;              // sizeof(latest_file_t)
+    uint32_t devices;           // slots in use, which only grows
+    latest_device_t device[LATEST_DEVICES];
+} latest_file_t;
+
+/**
+ * Copy device "i" of "file" (which is less than file->devices) into "copy".
+ * Returns false if the writer was part way through changing it on every
+ * try, which only happens if it died doing so.
+ */
+static inline bool latest_read(const latest_file_t *file, uint32_t i, latest_device_t *copy) {
+    const latest_device_t *device = &file->device[i];
+    for (int tries=0;tries<1000;tries++) {
+        uint32_t seq = __atomic_load_n(&device->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(copy, (const void *)device, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&device->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Make the slots, in shared memory called "shm" if it's not empty, and
+ * listen on "socket" if it's not empty. Returns 0 on success or -1 on
+ * failure, having printed why. Does nothing if both are empty.
+ */
+int latest_start(const char *shm, const char *socket);
+
+/**
+ * Return the slot for "serial", making it if need be, or NULL if there are
+ * no slots or none left. Only called by the reader.
+ */
+latest_device_t *latest_device(const char *serial);
+
+/**
+ * Record a reading. Only called by the reader.
+ */
+void latest_update(latest_device_t *device, const reading_t *reading);
+
+/**
+ * Stop listening and unmap the slots
+ */
+void latest_stop();
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Logging to stdout from a thread of its own - see log.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "cm160.h"
+#include "log.h"
+
+#define LIMITS          64          // call sites rate-limited at once; a power of two
+
+typedef struct {
+    uint64_t seq;               // == position when free, position + 1 when filled
+    int len;
+    char text[LOG_LINE];
+} slot_t;
+
+static slot_t ring[LOG_SLOTS];
+static uint64_t head, tail;     // head only moved by the writer, tail by those logging
+static uint64_t dropped;        // lines lost because the ring was full
+static pthread_t writer;
+static sem_t wakeup;
+static int wakeup_pending;
+static volatile bool running;
+
+// Errors and warnings logged recently, by format string
+static struct {
+    const char *fmt;
+    uint64_t period;            // time / LOG_PERIOD when it was first logged
+    uint32_t count, suppressed;
+} limits[LIMITS];
+
+/**
+ * Return true if a line from "fmt" may be logged now, setting "suppressed"
+ * to the number from it that weren't in the last period. The counts are
+ * only approximate if two threads log from the same place at once.
+ */
+static bool log_limit(const char *fmt, uint32_t *suppressed) {
+    uint64_t period = time(NULL) / LOG_PERIOD;
+    int i = ((uintptr_t)fmt >> 3) & (LIMITS - 1);
+    *suppressed = 0;
+    if (__atomic_load_n(&limits[i].fmt, __ATOMIC_RELAXED) != fmt || __atomic_load_n(&limits[i].period, __ATOMIC_RELAXED) != period) {
+        if (__atomic_load_n(&limits[i].fmt, __ATOMIC_RELAXED) == fmt) {
+            *suppressed = __atomic_exchange_n(&limits[i].suppressed, 0, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(&limits[i].suppressed, 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&limits[i].fmt, fmt, __ATOMIC_RELAXED);
+        __atomic_store_n(&limits[i].period, period, __ATOMIC_RELAXED);
+        __atomic_store_n(&limits[i].count, 1, __ATOMIC_RELAXED);
+        return true;
+    } else if (__atomic_add_fetch(&limits[i].count, 1, __ATOMIC_RELAXED) <= LOG_BURST) {
+        return true;
+    }
+    __atomic_add_fetch(&limits[i].suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * Format a line into the next free slot and hand it to the writer, or
+ * count it as dropped if the ring is full
+ */
+static void log_queue(const char *fmt, va_list ap) {
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    slot_t *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+    int len = vsnprintf(slot->text, LOG_LINE, fmt, ap);
+    if (len >= LOG_LINE) {
+        len = LOG_LINE - 1;
+        slot->text[len - 1] = '\n';
+    }
+    slot->len = len < 0 ? 0 : len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    if (!__atomic_exchange_n(&wakeup_pending, 1, __ATOMIC_SEQ_CST)) {
+        sem_post(&wakeup);
+    }
+}
+
+static void log_queuef(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_queue(fmt, ap);
+    va_end(ap);
+}
+
+void log_print(int level, const char *fmt, ...) {
+    uint32_t suppressed = 0;
+    if (level <= LOG_WARN && !log_limit(fmt, &suppressed)) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (suppressed) {
+            log_queuef("LOG: %u more like the next were suppressed\n", suppressed);
+        }
+        log_queue(fmt, ap);
+    } else {
+        if (suppressed) {
+            printf("LOG: %u more like the next were suppressed\n", suppressed);
+        }
+        vprintf(fmt, ap);
+    }
+    va_end(ap);
+}
+
+/**
+ * Write all of "len" bytes to stdout, unless it's gone
+ */
+static void write_all(const char *buf, int len) {
+    while (len > 0) {
+        ssize_t r = write(STDOUT_FILENO, buf, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            return;
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+static void *log_run(void *arg) {
+    static char buf[64 * 1024];
+    for (;;) {
+        __atomic_store_n(&wakeup_pending, 0, __ATOMIC_SEQ_CST);
+        // Copy out everything that's ready, so it goes in one write
+        int len = 0;
+        uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+        if (lost) {
+            len = snprintf(buf, sizeof(buf), "LOG: %lu lines dropped, stdout was behind\n", (unsigned long)lost);
+        }
+        for (;;) {
+            slot_t *slot = &ring[head & (LOG_SLOTS - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1 || len + slot->len > sizeof(buf)) {
+                break;
+            }
+            memcpy(buf + len, slot->text, slot->len);
+            len += slot->len;
+            __atomic_store_n(&slot->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+            head++;
+        }
+        if (len) {
+            write_all(buf, len);
+        } else if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            sem_timedwait(&wakeup, &ts);
+        }
+    }
+    return NULL;
+}
+
+void log_start() {
+    for (int i=0;i<LOG_SLOTS;i++) {
+        ring[i].seq = i;
+    }
+    head = tail = 0;
+    fflush(stdout);
+    sem_init(&wakeup, 0, 0);
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    int r;
+    if ((r=thread_start(&writer, log_run, NULL))) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        printf("ERROR: pthread_create returned %d (%s)\n", r, strerror(r));
+    } else {
+        atexit(log_stop);
+    }
+}
+
+void log_stop() {
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        sem_post(&wakeup);
+        pthread_join(writer, NULL);
+        sem_destroy(&wakeup);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Logging to stdout from a thread of its own
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Each line is formatted by the thread logging it into a slot of a ring in
+ * memory, and a writer thread copies whatever has accumulated to stdout
+ * with one write. Nothing that logs ever waits on stdout: if it stops
+ * taking output (a full pipe to journald, say) the ring fills, and lines
+ * are dropped and counted rather than holding up USB.
+ *
+ * The ring has a sequence number in each slot, as in Dmitry Vyukov's
+ * bounded MPMC queue, so any number of threads can log without a lock:
+ * a thread claims a slot by advancing the tail, fills it, and publishes it
+ * by setting its sequence number, which is what the writer waits for.
+ *
+ * Errors and warnings are rate-limited by where they're logged from (their
+ * format string): after LOG_BURST in LOG_PERIOD seconds the rest are
+ * counted, and the count logged when the next gets through.
+ *
+ * Until log_start() is called, and after log_stop(), lines are written
+ * straight to stdout.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_ERROR       0
+#define LOG_WARN        1
+#define LOG_INFO        2
+#define LOG_DEBUG       3
+
+#define LOG_SLOTS       1024        // lines; a power of two
+#define LOG_LINE        512         // the longest line, including the newline
+#define LOG_BURST       10
+#define LOG_PERIOD      60
+
+/**
+ * Log a line at "level". "fmt" should end with a newline.
+ */
+void log_print(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Start the writer thread
+ */
+void log_start();
+
+/**
+ * Write out anything waiting and stop the writer thread, if it was started
+ */
+void log_stop();
+
+#endif
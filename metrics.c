@@ -0,0 +1,294 @@
+/*
+ * Runtime metrics: counters and latency histograms - see metrics.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <mosquitto.h>
+#include "publish.h"
+#include "metrics.h"
+#include "sink.h"
+#include "log.h"
+
+process_metrics_t process_metrics;
+
+static const uint64_t latency_bounds[HISTOGRAM_BUCKETS] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000, 10000000 };
+static const uint64_t recovery_bounds[HISTOGRAM_BUCKETS] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000 };
+static const char *frame_types[FRAME_TYPES] = { "id", "wait", "live", "history", "history10" };
+
+// The counters in metrics_t, other than frames
+static const struct {
+    const char *name, *help;
+    size_t offset;
+} counters[] = {
+    { "checksum_errors", "Live frames with a bad checksum", offsetof(metrics_t, checksum_errors) },
+    { "unknown_frames", "Frames that weren't recognised", offsetof(metrics_t, unknown_frames) },
+    { "resyncs", "Times bytes were skipped to find the next frame", offsetof(metrics_t, resyncs) },
+    { "resync_bytes", "Bytes skipped to find the next frame", offsetof(metrics_t, resync_bytes) },
+    { "connects", "Times the device was brought up", offsetof(metrics_t, connects) },
+    { "disconnects", "Times the device was dropped", offsetof(metrics_t, disconnects) },
+    { "recoveries", "Times the line was reset because the link had gone wrong", offsetof(metrics_t, recoveries) },
+    { "recovery_failures", "Line resets that didn't help, so the device was reconnected", offsetof(metrics_t, recovery_failures) },
+    { "readings", "Readings queued for publication", offsetof(metrics_t, readings) },
+    { "published", "Readings published or added to a batch", offsetof(metrics_t, published) },
+    { "duplicates", "History readings dropped because they'd already been published", offsetof(metrics_t, duplicates) },
+    { "suppressed", "Live readings not published because they hadn't changed enough", offsetof(metrics_t, suppressed) },
+};
+
+static pthread_t server;
+static int server_fd = -1;
+static volatile bool serving;
+static uint64_t nextstats;
+
+static void histogram_record(histogram_t *h, const uint64_t *bounds, uint64_t v) {
+    int i = 0;
+    while (i < HISTOGRAM_BUCKETS && v > bounds[i]) {
+        i++;
+    }
+    METRIC_INC(h->count[i]);
+    METRIC_ADD(h->sum, v);
+    METRIC_INC(h->total);
+}
+
+void metrics_latency(metrics_t *metrics, uint64_t us) {
+    histogram_record(&metrics->latency, latency_bounds, us);
+}
+
+void metrics_recovery(metrics_t *metrics, uint64_t ms) {
+    histogram_record(&metrics->recovery, recovery_bounds, ms);
+}
+
+static uint64_t get(const uint64_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write the histogram at "offset" in each meter's metrics in Prometheus
+ * format, in seconds; "scale" is the number of its units in a second
+ */
+static void histogram_prometheus(FILE *f, const char *name, const char *help, size_t offset, const uint64_t *bounds, double scale) {
+    fprintf(f, "# HELP cm160_%s %s\n# TYPE cm160_%s histogram\n", name, help, name);
+    for (meter_t *meter=meter_first();meter;meter=meter->next) {
+        const histogram_t *h = (const histogram_t *)((const char *)&meter->metrics + offset);
+        uint64_t cumulative = 0;
+        for (int i=0;i<=HISTOGRAM_BUCKETS;i++) {
+            cumulative += get(&h->count[i]);
+            if (i < HISTOGRAM_BUCKETS) {
+                fprintf(f, "cm160_%s_bucket{serial=\"%s\",le=\"%g\"} %" PRIu64 "\n", name, meter->serial, bounds[i] / scale, cumulative);
+            } else {
+                fprintf(f, "cm160_%s_bucket{serial=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", name, meter->serial, cumulative);
+            }
+        }
+        fprintf(f, "cm160_%s_sum{serial=\"%s\"} %g\n", name, meter->serial, get(&h->sum) / scale);
+        fprintf(f, "cm160_%s_count{serial=\"%s\"} %" PRIu64 "\n", name, meter->serial, get(&h->total));
+    }
+}
+
+void metrics_prometheus(FILE *f) {
+    fprintf(f, "# HELP cm160_frames_total Frames decoded, by type\n# TYPE cm160_frames_total counter\n");
+    for (meter_t *meter=meter_first();meter;meter=meter->next) {
+        for (int i=0;i<FRAME_TYPES;i++) {
+            fprintf(f, "cm160_frames_total{serial=\"%s\",type=\"%s\"} %" PRIu64 "\n", meter->serial, frame_types[i], get(&meter->metrics.frames[i]));
+        }
+    }
+    for (int i=0;i<(int)(sizeof(counters)/sizeof(counters[0]));i++) {
+        fprintf(f, "# HELP cm160_%s_total %s\n# TYPE cm160_%s_total counter\n", counters[i].name, counters[i].help, counters[i].name);
+        for (meter_t *meter=meter_first();meter;meter=meter->next) {
+            fprintf(f, "cm160_%s_total{serial=\"%s\"} %" PRIu64 "\n", counters[i].name, meter->serial, get((const uint64_t *)((const char *)&meter->metrics + counters[i].offset)));
+        }
+    }
+    fprintf(f, "# HELP cm160_readings_dropped_total Readings lost because the publisher was too far behind\n# TYPE cm160_readings_dropped_total counter\n");
+    for (meter_t *meter=meter_first();meter;meter=meter->next) {
+        fprintf(f, "cm160_readings_dropped_total{serial=\"%s\"} %" PRIu64 "\n", meter->serial, get(&meter->dropped));
+    }
+    histogram_prometheus(f, "publish_latency_seconds", "Time from the USB read to publication", offsetof(metrics_t, latency), latency_bounds, 1e6);
+    histogram_prometheus(f, "recovery_seconds", "Time from resetting the line to the link working again", offsetof(metrics_t, recovery), recovery_bounds, 1e3);
+    const char *target;
+    uint64_t dropped;
+    fprintf(f, "# HELP cm160_sink_dropped_total Readings a --sink dropped because it was too far behind\n# TYPE cm160_sink_dropped_total counter\n");
+    for (int i=0;(target = sink_dropped(i, &dropped));i++) {
+        fprintf(f, "cm160_sink_dropped_total{sink=\"%s\"} %" PRIu64 "\n", target, dropped);
+    }
+    fprintf(f, "# HELP cm160_publish_errors_total Messages that couldn't be published or spooled\n# TYPE cm160_publish_errors_total counter\ncm160_publish_errors_total %" PRIu64 "\n", get(&process_metrics.publish_errors));
+    fprintf(f, "# HELP cm160_spool_dropped_total Messages dropped from the spool because it was full\n# TYPE cm160_spool_dropped_total counter\ncm160_spool_dropped_total %" PRIu64 "\n", get(&process_metrics.spool_dropped));
+    fprintf(f, "# HELP cm160_spool_pending Messages in the spool not yet sent\n# TYPE cm160_spool_pending gauge\ncm160_spool_pending %" PRIu64 "\n", get(&process_metrics.spool_pending));
+}
+
+/**
+ * Answer one HTTP request
+ */
+static void serve(int fd) {
+    char req[1024];
+    int len = 0, r;
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // We only need the request line
+    while (len < (int)sizeof(req) - 1 && (r = read(fd, req + len, sizeof(req) - 1 - len)) > 0) {
+        len += r;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[len] = 0;
+    char *body = NULL;
+    size_t bodylen = 0;
+    FILE *f = open_memstream(&body, &bodylen);
+    bool found = !strncmp(req, "GET /metrics", 12) && (req[12] == ' ' || req[12] == '?');
+    if (found) {
+        metrics_prometheus(f);
+    } else {
+        fprintf(f, "Not found\n");
+    }
+    fclose(f);
+    char head[200];
+    int headlen = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", bodylen);
+    if (write(fd, head, headlen) != headlen || write(fd, body, bodylen) != (ssize_t)bodylen) {
+        // the client went away; nothing to do
+    }
+    free(body);
+}
+
+static void *server_run(void *arg) {
+    while (serving) {
+        struct pollfd p = { server_fd, POLLIN, 0 };
+        if (poll(&p, 1, 1000) <= 0) {
+            continue;
+        }
+        int fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            serve(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+int metrics_start(int port) {
+    struct sockaddr_in addr;
+    int one = 1, r;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        log_print(LOG_ERROR, "ERROR: metrics: socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_fd, 4) < 0) {
+        log_print(LOG_ERROR, "ERROR: metrics: can't listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+    serving = true;
+    if ((r=thread_start(&server, server_run, NULL))) {
+        log_print(LOG_ERROR, "ERROR: pthread_create returned %d (%s)\n", r, strerror(r));
+        serving = false;
+    }
+    return serving ? 0 : -1;
+}
+
+void metrics_stop() {
+    if (serving) {
+        serving = false;
+        pthread_join(server, NULL);
+    }
+    if (server_fd >= 0) {
+        close(server_fd);
+        server_fd = -1;
+    }
+}
+
+/**
+ * Return an estimate of the "pct" percentile of a histogram: the upper
+ * bound of the bucket it falls in
+ */
+static uint64_t histogram_percentile(const histogram_t *h, const uint64_t *bounds, int pct) {
+    uint64_t total = get(&h->total), seen = 0;
+    for (int i=0;i<HISTOGRAM_BUCKETS;i++) {
+        seen += get(&h->count[i]);
+        if (total && seen * 100 >= total * pct) {
+            return bounds[i];
+        }
+    }
+    return total ? bounds[HISTOGRAM_BUCKETS - 1] : 0;
+}
+
+int metrics_poll() {
+    if (!strlen(stats_topic) || !mosq) {
+        return 1000;
+    }
+    uint64_t now = millis();
+    if (now < nextstats) {
+        return nextstats - now < 1000 ? nextstats - now : 1000;
+    }
+    nextstats = now + stats_interval * 1000ULL;
+    for (meter_t *meter=meter_first();meter;meter=meter->next) {
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&buf, &len);
+        const metrics_t *m = &meter->metrics;
+        fprintf(f, "{\"type\":\"stats\",\"serial\":\"%s\",\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\",\"frames\":{", meter->serial, now / 1000, programname, hostname);
+        for (int i=0;i<FRAME_TYPES;i++) {
+            fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", frame_types[i], get(&m->frames[i]));
+        }
+        fprintf(f, "}");
+        for (int i=0;i<(int)(sizeof(counters)/sizeof(counters[0]));i++) {
+            fprintf(f, ",\"%s\":%" PRIu64, counters[i].name, get((const uint64_t *)((const char *)m + counters[i].offset)));
+        }
+        uint64_t total = get(&m->latency.total);
+        fprintf(f, ",\"dropped\":%" PRIu64 ",\"latency_us\":{\"count\":%" PRIu64 ",\"mean\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 "}}", get(&meter->dropped), total, total ? get(&m->latency.sum) / total : 0, histogram_percentile(&m->latency, latency_bounds, 50), histogram_percentile(&m->latency, latency_bounds, 99));
+        fclose(f);
+        int r;
+        if ((r=mosquitto_publish(mosq, NULL, stats_topic, len, buf, 0, false)) && r != MOSQ_ERR_NO_CONN) {
+            log_print(LOG_ERROR, "ERROR: mosquitto_publish returned %d (%s)\n", r, mosquitto_strerror(r));
+        }
+        free(buf);
+    }
+    const char *target;
+    uint64_t dropped;
+    if (sink_dropped(0, &dropped)) {
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&buf, &len);
+        fprintf(f, "{\"type\":\"sinks\",\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\",\"dropped\":{", now / 1000, programname, hostname);
+        for (int i=0;(target = sink_dropped(i, &dropped));i++) {
+            fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", target, dropped);
+        }
+        fprintf(f, "}}");
+        fclose(f);
+        int r;
+        if ((r=mosquitto_publish(mosq, NULL, stats_topic, len, buf, 0, false)) && r != MOSQ_ERR_NO_CONN) {
+            log_print(LOG_ERROR, "ERROR: mosquitto_publish returned %d (%s)\n", r, mosquitto_strerror(r));
+        }
+        free(buf);
+    }
+    return 1000;
+}
@@ -0,0 +1,111 @@
+/*
+ * Runtime metrics: counters and latency histograms
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Each meter has a metrics_t, kept for as long as the program runs. Every
+ * value is a uint64_t with only one thread writing it - frame counts by
+ * the reader, publish counts by the publisher - so recording one is a
+ * relaxed atomic load and store, without even a locked instruction, and
+ * never allocates. Readers of the metrics may see one counter a little
+ * ahead of another, which doesn't matter. Histograms have fixed buckets.
+ *
+ * They can be read in Prometheus text format from a local HTTP endpoint
+ * (--metrics-port) and are published periodically as JSON to an MQTT topic
+ * (--stats-topic).
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define METRIC_ADD(counter, n)  __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRIC_INC(counter)     METRIC_ADD(counter, 1)
+#define METRIC_SET(gauge, v)    __atomic_store_n(&(gauge), (v), __ATOMIC_RELAXED)
+
+#define FRAME_TYPE_ID           0
+#define FRAME_TYPE_WAIT         1
+#define FRAME_TYPE_LIVE         2
+#define FRAME_TYPE_HISTORY      3
+#define FRAME_TYPE_HISTORY10    4           // history frames missing the minute byte
+#define FRAME_TYPES             5
+
+#define HISTOGRAM_BUCKETS       12
+
+typedef struct {
+    uint64_t count[HISTOGRAM_BUCKETS + 1];  // the last is everything over the largest bound
+    uint64_t sum, total;
+} histogram_t;
+
+typedef struct {
+    uint64_t frames[FRAME_TYPES];
+    uint64_t checksum_errors;               // live frames with a bad checksum
+    uint64_t unknown_frames;
+    uint64_t resyncs, resync_bytes;
+    uint64_t connects, disconnects;
+    uint64_t recoveries, recovery_failures;
+    uint64_t readings;                      // queued for the publisher
+    uint64_t published;                     // published, or added to a batch
+    uint64_t duplicates;                    // history dropped as already published
+    uint64_t suppressed;                    // live readings not published because of --filter
+    histogram_t latency;                    // USB read to publish, microseconds
+    histogram_t recovery;                   // line recovery time, milliseconds
+} metrics_t;
+
+// Metrics for the process rather than a meter
+typedef struct {
+    uint64_t publish_errors;
+    uint64_t spool_dropped, spool_pending;  // as last seen by the publisher
+} process_metrics_t;
+
+extern process_metrics_t process_metrics;
+
+/**
+ * Return a monotonic time in microseconds, for measuring latency
+ */
+static inline uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Record a publish latency in microseconds
+ */
+void metrics_latency(metrics_t *metrics, uint64_t us);
+
+/**
+ * Record how long a line recovery took in milliseconds
+ */
+void metrics_recovery(metrics_t *metrics, uint64_t ms);
+
+/**
+ * Write every meter's metrics to "f" in Prometheus text format
+ */
+void metrics_prometheus(FILE *f);
+
+/**
+ * Start serving /metrics over HTTP on 127.0.0.1:"port" from a thread of
+ * its own. Returns 0 on success or -1 on failure, having printed why.
+ */
+int metrics_start(int port);
+
+/**
+ * Stop the HTTP server, if it was started
+ */
+void metrics_stop();
+
+/**
+ * Publish each meter's metrics to the stats topic if they're due, and
+ * return the milliseconds until they next are (at most 1000). Called by
+ * the publisher.
+ */
+int metrics_poll();
+
+#endif
@@ -0,0 +1,506 @@
+/*
+ * Publishing readings, on a thread of its own - see publish.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <mosquitto.h>
+#include "publish.h"
+#include "sink.h"
+#include "log.h"
+
+bool publisher_block;
+static meter_t *meters;
+static pthread_t publisher;
+static sem_t wakeup;
+static int wakeup_pending;
+static volatile bool threaded, publishing;
+static volatile int mqtt_connected, mqtt_rewind;
+
+// Messages sent from the spool but not yet acknowledged by the broker,
+// oldest first. The spool is committed up to the last of an unbroken
+// run of acknowledged ones.
+#define MAXINFLIGHT 20
+static struct {
+    int mid;
+    bool acked;
+    uint64_t position;
+} inflight[MAXINFLIGHT];
+static int inflight_head, inflight_count;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static filter_t filters[MAXFILTERS];
+static int nfilters;
+
+int filter_parse(const char *spec) {
+    if (nfilters == MAXFILTERS) {
+        printf("Too many filters (at most %d)\n", MAXFILTERS);
+        return -1;
+    }
+    filter_t *filter = &filters[nfilters];
+    const char *eq = strchr(spec, '=');
+    if (eq) {
+        if (eq - spec >= sizeof(filter->serial)) {
+            printf("Invalid filter \"%s\"\n", spec);
+            return -1;
+        }
+        memcpy(filter->serial, spec, eq - spec);
+        spec = eq + 1;
+    }
+    int min, heartbeat, n;
+    if (sscanf(spec, "%d,%d,%d,%d%n", &filter->watts, &filter->percent, &min, &heartbeat, &n) != 4 || spec[n] || filter->watts < 0 || filter->percent < 0 || min < 0 || heartbeat < 0) {
+        printf("Invalid filter \"%s\" (watts,percent,min-secs,heartbeat-secs)\n", spec);
+        return -1;
+    }
+    filter->min_ms = min * 1000;
+    filter->heartbeat_ms = heartbeat * 1000;
+    nfilters++;
+    return 0;
+}
+
+/**
+ * Return the filter for "serial", or NULL if there isn't one
+ */
+static const filter_t *filter_get(const char *serial) {
+    const filter_t *filter = NULL;
+    for (int i=0;i<nfilters;i++) {
+        if (!strcmp(filters[i].serial, serial)) {
+            return &filters[i];
+        } else if (!filters[i].serial[0]) {
+            filter = &filters[i];
+        }
+    }
+    return filter;
+}
+
+/**
+ * Return true if a live reading should be published. Only looks at the
+ * last one published, so costs the same however long it's been running.
+ */
+static bool filter_pass(meter_t *meter, const reading_t *reading) {
+    const filter_t *filter = meter->filter;
+    if (meter->lastpublished) {
+        uint64_t elapsed = (reading->readtime - meter->lastpublished) / 1000;
+        if (!filter->heartbeat_ms || elapsed < filter->heartbeat_ms) {
+            int32_t change = abs(reading->watts - meter->lastwatts);
+            int32_t deadband = abs(meter->lastwatts) * filter->percent / 100;
+            if (deadband < filter->watts) {
+                deadband = filter->watts;
+            }
+            if (elapsed < filter->min_ms || change <= deadband) {
+                return false;
+            }
+        }
+    }
+    meter->lastwatts = reading->watts;
+    meter->lastpublished = reading->readtime;
+    return true;
+}
+
+meter_t *meter_get(const char *serial) {
+    for (meter_t *meter=meters;meter;meter=meter->next) {
+        if (!strcmp(meter->serial, serial)) {
+            return meter;
+        }
+    }
+    meter_t *meter = calloc(sizeof(meter_t), 1);
+    strncpy(meter->serial, serial, sizeof(meter->serial) - 1);
+    format_init(&meter->format, output_format, serial, programname, hostname, voltage);
+    if (batch_records) {
+        meter->batch = malloc(batch_bytes);
+        meter->batchseen = malloc(batch_records * sizeof(*meter->batchseen));
+    }
+    if (strlen(state_dir)) {
+        meter->seen = seen_open(state_dir, meter->serial);
+    }
+    if (rollup_enabled()) {
+        meter->rollup = rollup_new();
+    }
+    meter->filter = filter_get(serial);
+    meter->latest = latest_device(serial);
+    meter->next = meters;
+    // The publisher walks the list without a lock, so it must see the meter complete
+    __atomic_store_n(&meters, meter, __ATOMIC_RELEASE);
+    return meter;
+}
+
+meter_t *meter_first() {
+    return __atomic_load_n(&meters, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Wake the publisher thread, unless it's already been woken and hasn't
+ * yet looked at the queues
+ */
+static void publisher_wake() {
+    if (threaded && !__atomic_exchange_n(&wakeup_pending, 1, __ATOMIC_SEQ_CST)) {
+        sem_post(&wakeup);
+    }
+}
+
+void meter_push(meter_t *meter, const reading_t *reading) {
+    uint32_t head = meter->head;
+    while (head - __atomic_load_n(&meter->tail, __ATOMIC_ACQUIRE) == METER_QUEUE) {
+        if (!publisher_block) {
+            uint64_t dropped = __atomic_add_fetch(&meter->dropped, 1, __ATOMIC_RELAXED);
+            if (!(dropped & (dropped - 1))) {
+                log_print(LOG_ERROR, "ERROR: %s: publisher is behind, %" PRIu64 " readings dropped\n", meter->serial, dropped);
+            }
+            return;
+        }
+        publisher_wake();
+        usleep(1000);
+    }
+    meter->queue[head & (METER_QUEUE - 1)] = *reading;
+    __atomic_store_n(&meter->head, head + 1, __ATOMIC_RELEASE);
+    METRIC_INC(meter->metrics.readings);
+    publisher_wake();
+}
+
+int publish(const char *topic, const void *payload, int len) {
+    int r;
+    if (spool) {
+        if (spool_append(spool, topic, payload, len) < 0) {
+            log_print(LOG_ERROR, "ERROR: spool: message of %d bytes dropped\n", len);
+            METRIC_INC(process_metrics.publish_errors);
+            return -1;
+        }
+    } else if (mosq && (r=mosquitto_publish(mosq, NULL, topic, len, payload, mqtt_qos, false))) {
+        log_print(LOG_ERROR, "ERROR: mosquitto_publish returned %d (%s)\n", r, mosquitto_strerror(r));
+        METRIC_INC(process_metrics.publish_errors);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send messages from the spool to the broker, at no more than drain_rate
+ * a second and with no more than MAXINFLIGHT awaiting acknowledgement,
+ * and commit those that have been acknowledged. Returns how many
+ * milliseconds until it next wants to run (at most 1000).
+ */
+static int spool_drain() {
+    static uint64_t last, lastsync;
+    static double tokens;
+    uint64_t now = millis();
+    if (mqtt_rewind) {
+        // Anything unacknowledged when the connection dropped is sent again
+        pthread_mutex_lock(&inflight_lock);
+        inflight_count = 0;
+        mqtt_rewind = 0;
+        pthread_mutex_unlock(&inflight_lock);
+        spool_rewind(spool);
+    }
+    uint64_t commit = 0;
+    pthread_mutex_lock(&inflight_lock);
+    while (inflight_count && inflight[inflight_head].acked) {
+        commit = inflight[inflight_head].position;
+        inflight_head = (inflight_head + 1) % MAXINFLIGHT;
+        inflight_count--;
+    }
+    pthread_mutex_unlock(&inflight_lock);
+    if (commit) {
+        spool_commit(spool, commit);
+    }
+    if (now - lastsync >= 1000) {
+        spool_sync(spool);
+        lastsync = now;
+    }
+
+    tokens += (now - last) * drain_rate / 1000.0;
+    if (tokens > drain_rate) {
+        tokens = drain_rate;
+    }
+    last = now;
+    const char *topic;
+    const void *payload;
+    int len, r;
+    while (mqtt_connected && tokens >= 1 && inflight_count < MAXINFLIGHT && !spool_peek(spool, &topic, &payload, &len)) {
+        int mid;
+        pthread_mutex_lock(&inflight_lock);
+        if ((r=mosquitto_publish(mosq, &mid, topic, len, payload, mqtt_qos, false))) {
+            pthread_mutex_unlock(&inflight_lock);
+            log_print(LOG_ERROR, "ERROR: mosquitto_publish returned %d (%s)\n", r, mosquitto_strerror(r));
+            METRIC_INC(process_metrics.publish_errors);
+            break;
+        }
+        int i = (inflight_head + inflight_count++) % MAXINFLIGHT;
+        inflight[i].mid = mid;
+        inflight[i].acked = false;
+        inflight[i].position = spool_next(spool);
+        pthread_mutex_unlock(&inflight_lock);
+        tokens--;
+    }
+    if (mqtt_connected && spool_pending(spool)) {
+        int wait = 1000 / drain_rate;
+        return wait < 10 ? 10 : wait;
+    }
+    return 1000;
+}
+
+/**
+ * Publish any history records batched for this meter as one message -
+ * a JSON array, for example.
+ */
+static void batch_flush(meter_t *meter) {
+    if (meter->batchcount) {
+        int len;
+        const char *close = format_batch_close(output_format, &len);
+        memcpy(meter->batch + meter->batchlen, close, len);
+        meter->batchlen += len;
+        if (!publish(mqtt_topic, meter->batch, meter->batchlen) && meter->seen) {
+            for (int i=0;i<meter->batchcount;i++) {
+                seen_add(meter->seen, meter->batchseen[i].unitwhen, meter->batchseen[i].amps);
+            }
+        }
+        if (debug) {
+            log_print(LOG_DEBUG, "Published batch of %d history records (%d bytes)\n", meter->batchcount, meter->batchlen);
+        }
+        meter->batchlen = meter->batchcount = 0;
+    }
+}
+
+/**
+ * Add a history record to the meter's batch. The batch is published
+ * first if the record wouldn't fit, and afterwards if it's now full.
+ */
+static void batch_add(meter_t *meter, const reading_t *reading, const char *buf, int len) {
+    if (meter->batchcount && meter->batchlen + len + 2 > batch_bytes) {
+        batch_flush(meter);
+    }
+    int seplen;
+    const char *sep = meter->batchcount ? format_batch_separator(output_format, &seplen) : format_batch_open(output_format, &seplen);
+    memcpy(meter->batch + meter->batchlen, sep, seplen);
+    meter->batchlen += seplen;
+    if (!meter->batchcount) {
+        meter->batchstart = millis();
+    }
+    memcpy(meter->batch + meter->batchlen, buf, len);
+    meter->batchlen += len;
+    meter->batchseen[meter->batchcount].unitwhen = reading->unitwhen;
+    meter->batchseen[meter->batchcount].amps = reading->amps;
+    if (++meter->batchcount == batch_records) {
+        batch_flush(meter);
+    }
+}
+
+/**
+ * Publish any batches that have been waiting longer than batch_ms, and
+ * return how many milliseconds until the next one falls due (at most 1000).
+ */
+static int batch_expire() {
+    uint64_t now = millis();
+    int wait = 1000;
+    for (meter_t *meter=__atomic_load_n(&meters, __ATOMIC_ACQUIRE);meter;meter=meter->next) {
+        if (meter->batchcount) {
+            int64_t remaining = (int64_t)(meter->batchstart + batch_ms - now);
+            if (remaining <= 0) {
+                batch_flush(meter);
+            } else if (remaining < wait) {
+                wait = remaining;
+            }
+        }
+    }
+    return wait;
+}
+
+/**
+ * Store, serialise and publish one reading taken from a meter's queue
+ */
+static void publish_reading(meter_t *meter, const reading_t *reading) {
+    if (store) {
+        store_append(store, meter->serial, reading->unitwhen, reading->amps, (reading->old ? 0 : STORE_NEW) | (reading->more ? STORE_MORE : 0));
+    }
+    bool duplicate = reading->old && meter->seen && seen_check(meter->seen, reading->unitwhen, reading->amps);
+    if (meter->rollup) {
+        rollup_add(meter->rollup, meter->serial, reading, duplicate);
+    }
+    if (duplicate) {
+        METRIC_INC(meter->metrics.duplicates);
+        return;
+    }
+    if (!reading->old && meter->filter && !filter_pass(meter, reading)) {
+        METRIC_INC(meter->metrics.suppressed);
+        return;
+    }
+    if (all || !reading->old) {
+        char buf[FORMAT_MAX];
+        int len = format_reading(&meter->format, reading, buf);
+        // History only counts as seen once it's been handed on, which for
+        // a batch is when the batch is published
+        if (reading->old && meter->batch) {
+            batch_add(meter, reading, buf, len);
+        } else if (!publish(mqtt_topic, buf, len) && meter->seen) {
+            seen_add(meter->seen, reading->unitwhen, reading->amps);
+        }
+        sink_write(buf, len);
+        METRIC_INC(meter->metrics.published);
+        metrics_latency(&meter->metrics, monotonic_us() - reading->readtime);
+        if (format_text(output_format) && !quiet) {
+            log_print(LOG_INFO, "%.*s\n", len, buf);
+        }
+    }
+}
+
+int publisher_poll() {
+    for (meter_t *meter=__atomic_load_n(&meters, __ATOMIC_ACQUIRE);meter;meter=meter->next) {
+        uint32_t tail = meter->tail, head = __atomic_load_n(&meter->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            publish_reading(meter, &meter->queue[tail & (METER_QUEUE - 1)]);
+            __atomic_store_n(&meter->tail, ++tail, __ATOMIC_RELEASE);
+        }
+        if (meter->rollup) {
+            rollup_flush(meter->rollup, meter->serial);
+        }
+    }
+    int wait = batch_expire();
+    if (spool) {
+        int drainwait = spool_drain();
+        if (drainwait < wait) {
+            wait = drainwait;
+        }
+        METRIC_SET(process_metrics.spool_pending, spool_pending(spool));
+        METRIC_SET(process_metrics.spool_dropped, spool_dropped(spool));
+    }
+    int statswait = metrics_poll();
+    if (statswait < wait) {
+        wait = statswait;
+    }
+    return wait;
+}
+
+static void *publisher_run(void *arg) {
+    int wait = 0;
+    while (publishing) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += (wait % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&wakeup, &ts);
+        __atomic_store_n(&wakeup_pending, 0, __ATOMIC_SEQ_CST);
+        wait = publisher_poll();
+    }
+    return NULL;
+}
+
+void publisher_start() {
+    sem_init(&wakeup, 0, 0);
+    publishing = threaded = true;
+    int r;
+    if ((r=thread_start(&publisher, publisher_run, NULL))) {
+        log_print(LOG_ERROR, "ERROR: pthread_create returned %d (%s)\n", r, strerror(r));
+        exit(-1);
+    }
+}
+
+void publisher_stop() {
+    if (threaded) {
+        publishing = false;
+        sem_post(&wakeup);
+        pthread_join(publisher, NULL);
+        threaded = false;
+        sem_destroy(&wakeup);
+    }
+    publisher_poll();
+    for (meter_t *meter=meters;meter;meter=meter->next) {
+        batch_flush(meter);
+        if (meter->seen) {
+            seen_close(meter->seen);
+            meter->seen = NULL;
+        }
+    }
+    if (spool) {
+        spool_drain();
+    }
+}
+
+static void mqttConnect(struct mosquitto *mosq, void *obj, int rc) {
+    if (rc) {
+        log_print(LOG_INFO, "MQTT: connect to %s:%d failed: %d\n", mqtt_server, mqtt_port, rc);
+    } else {
+        log_print(LOG_INFO, "MQTT: connected to %s:%d\n", mqtt_server, mqtt_port);
+        mqtt_connected = 1;
+    }
+}
+
+static void mqttDisconnect(struct mosquitto *mosq, void *obj, int rc) {
+    log_print(LOG_INFO, "MQTT: disconnected from %s:%d: %d\n", mqtt_server, mqtt_port, rc);
+    mqtt_connected = 0;
+    mqtt_rewind = 1;
+}
+
+static void mqttPublish(struct mosquitto *mosq, void *obj, int mid) {
+    pthread_mutex_lock(&inflight_lock);
+    for (int i=0;i<inflight_count;i++) {
+        int j = (inflight_head + i) % MAXINFLIGHT;
+        if (inflight[j].mid == mid) {
+            inflight[j].acked = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+void mqtt_start() {
+    char buf[200];
+    int r;
+    int keepalive = 60;
+    bool clean_session = true;
+    mosquitto_lib_init();
+    mosq = mosquitto_new(NULL, clean_session, NULL);
+    if (!mosq) {
+        log_print(LOG_ERROR, "ERROR: Mosquitto init failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+//    mosquitto_log_callback_set(mosq, mqttLog);
+    mosquitto_disconnect_callback_set(mosq, mqttDisconnect);
+    mosquitto_connect_callback_set(mosq, mqttConnect);
+    mosquitto_publish_callback_set(mosq, mqttPublish);
+    if (strlen(mqtt_announce_topic)) {
+        char buf[180];
+        sprintf(buf, "{\"type\":\"announce\",\"connect\":false,\"who\":\"%s\",\"where\":\"%s\"}", programname, hostname);
+        mosquitto_will_set(mosq, mqtt_announce_topic, strlen(buf), buf, 0, false);
+    }
+    if (spool) {
+        // Readings are safe in the spool, so start even if the broker isn't there yet
+        mosquitto_reconnect_delay_set(mosq, 1, 30, true);
+        if ((r=mosquitto_connect_async(mosq, mqtt_server, mqtt_port, keepalive))) {
+            log_print(LOG_INFO, "MQTT: connect to %s:%d failed: %s, will retry\n", mqtt_server, mqtt_port, mosquitto_strerror(r));
+        }
+    } else if (mosquitto_connect(mosq, mqtt_server, mqtt_port, keepalive)) {
+        log_print(LOG_ERROR, "ERROR: Mosquitto connect failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+    if (mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        log_print(LOG_ERROR, "ERROR: Mosquitto loop failed: %s\n", strerror(errno));
+        exit(-1);
+    }
+    if (strlen(mqtt_announce_topic)) {
+        sprintf(buf, "{\"type\":\"announce\",\"connect\":true,\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\"}", millis()/1000, programname, hostname);
+        mosquitto_publish(mosq, NULL, mqtt_announce_topic, strlen(buf), buf, 0, 0);
+    }
+}
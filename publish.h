@@ -0,0 +1,128 @@
+/*
+ * Publishing readings, on a thread of its own
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * The thread reading from USB decodes frames and replies to the unit, and
+ * nothing else: every reading is pushed onto a queue for its meter and
+ * everything that can be slow - storing, serialising, batching, printing,
+ * the spool and the broker - happens on the publisher thread. A reply to
+ * the unit never waits on any of it.
+ *
+ * Each queue has one producer (the reader) and one consumer (the
+ * publisher), so needs no lock: the reader only writes "head" and the
+ * publisher only writes "tail". If the publisher falls a whole queue
+ * behind, readings are dropped and counted rather than holding up the
+ * reader.
+ */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "cm160.h"
+#include "metrics.h"
+#include "seen.h"
+#include "rollup.h"
+#include "latest.h"
+
+#define METER_QUEUE     1024    // readings; a power of two
+#define MAXFILTERS      8
+
+/**
+ * Which live readings are worth publishing. A reading is suppressed unless
+ * its watts differ from the last published by more than the larger of
+ * "watts" and "percent" of it, and "min_ms" has passed since then - or
+ * unless "heartbeat_ms" has passed, which publishes it regardless. Zero
+ * turns each of them off, so the default only suppresses repeats.
+ */
+typedef struct {
+    char serial[80];            // the device this is for, or empty for any
+    int watts, percent;
+    int min_ms, heartbeat_ms;
+} filter_t;
+
+typedef struct meter_struct {
+    char serial[80];
+    format_t format;            // template for this meter's messages
+    reading_t queue[METER_QUEUE];
+    uint32_t head, tail;        // free-running; head written by the reader, tail by the publisher
+    uint64_t dropped;           // readings lost because the queue was full
+    metrics_t metrics;
+    seen_t *seen;               // history already published, if there's a state directory
+    rollup_t *rollup;           // if there are rollup windows
+    const filter_t *filter;     // if live readings are filtered
+    latest_device_t *latest;    // where the reader keeps its latest reading, if anywhere
+    int32_t lastwatts;          // the last live reading published
+    uint64_t lastpublished;     // ... when it was read, in monotonic microseconds, or 0 for never
+    char *batch;                // history records waiting to be published as one message
+    int batchlen, batchcount;
+    struct {
+        int64_t unitwhen;
+        uint16_t amps;
+    } *batchseen;               // ... what each was, to add to "seen" once the batch is published
+    uint64_t batchstart;
+    struct meter_struct *next;
+} meter_t;
+
+/**
+ * Add a filter from "[serial=]watts,percent,min-secs,heartbeat-secs". One
+ * for a serial overrides one without. Returns 0 on success or -1 if it's
+ * invalid, having printed why.
+ */
+int filter_parse(const char *spec);
+
+/**
+ * Return the meter for "serial", creating it if this is the first time
+ * it's been seen. Meters last until the program exits, so a device that
+ * reconnects keeps its queue and batch. Only called by the reader.
+ */
+meter_t *meter_get(const char *serial);
+
+/**
+ * Return the first meter in the list, which may be walked from any thread
+ */
+meter_t *meter_first();
+
+/**
+ * Queue a reading for publication. Only called by the reader. Never
+ * blocks unless publisher_block is set, as it is for replays.
+ */
+void meter_push(meter_t *meter, const reading_t *reading);
+
+extern bool publisher_block;
+
+/**
+ * Publish a message, via the spool if there is one. Never blocks. Only
+ * called by the publisher. Returns 0 if it was handed on, or -1 if it was
+ * dropped, having logged why.
+ */
+int publish(const char *topic, const void *payload, int len);
+
+/**
+ * Connect to the broker, and announce ourselves if asked to
+ */
+void mqtt_start();
+
+/**
+ * Start the publisher thread
+ */
+void publisher_start();
+
+/**
+ * Publish whatever is queued and do any batch and spool work that's due,
+ * returning how many milliseconds until there's more to do. This is the
+ * publisher thread's loop body, and is called directly when there's no
+ * thread, as in the benchmark.
+ */
+int publisher_poll();
+
+/**
+ * Stop the publisher thread, if there is one, once everything queued has
+ * been published and any batches flushed
+ */
+void publisher_stop();
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * A decoded CM160 reading
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#ifndef READING_H
+#define READING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef struct {
+    time_t unitwhen;            // the minute this reading is for, by the unit's clock
+    uint64_t when;              // seconds since 1970 when it was received
+    uint16_t amps;              // mean over the minute as reported, x 0.07 for amps
+    int32_t watts;              // amps x voltage
+    bool more;                  // the unit says it has more data
+    bool old;                   // history rather than live
+    uint64_t readtime;          // monotonic microseconds when the USB read it came in completed
+} reading_t;
+
+/**
+ * Return local standard time minus UTC at "t", in seconds. The unit's clock
+ * is read as standard time all year round (see unit_time() in cm160.c), so
+ * this is what its days and hours start by, whether or not DST is in force.
+ */
+static inline long reading_offset(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    tm.tm_isdst = 0;
+    return t - mktime(&tm);
+}
+
+/**
+ * Return amps x 100 for the raw value reported by the unit, exactly
+ */
+static inline uint32_t reading_centiamps(uint16_t amps) {
+    return amps * 7;
+}
+
+/**
+ * Return watts for the raw value reported by the unit at the given voltage
+ */
+static inline int32_t reading_watts(uint16_t amps, int voltage) {
+    return (int32_t)(reading_centiamps(amps) * voltage / 100);
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Energy rollups - see rollup.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "publish.h"
+#include "log.h"
+#include "rollup.h"
+
+#define WORDS           (ROLLUP_MINUTES / 64)
+#define MASK            (ROLLUP_MINUTES - 1)
+#define HORIZON         (ROLLUP_MINUTES - ROLLUP_MAXLEN)    // how far back a reading's windows are all still here
+
+struct rollup_struct {
+    uint64_t slot[ROLLUP_MINUTES];          // minute << 16 | amps, or 0 for none
+    int64_t clock;                          // the latest minute seen
+    // Windows waiting to be published and those of them changed after
+    // they closed, one bit for each, by start minute
+    uint64_t dirty[ROLLUP_WINDOWS][WORDS];
+    uint64_t late[ROLLUP_WINDOWS][WORDS];
+    int64_t due;                            // the minute the first dirty window closes by, or INT64_MAX
+};
+
+static struct {
+    char name[8];
+    int len;                                // minutes
+} windows[ROLLUP_WINDOWS];
+static int nwindows;
+
+int rollup_parse(const char *spec) {
+    char buf[200];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    nwindows = 0;
+    for (char *save, *s=strtok_r(buf, ",", &save);s;s=strtok_r(NULL, ",", &save)) {
+        int n;
+        char unit, extra;
+        if (sscanf(s, "%d%c%c", &n, &unit, &extra) != 2 || n <= 0 || strlen(s) >= sizeof(windows[0].name)) {
+            printf("Invalid rollup window \"%s\" (like 15m, 1h or 1d)\n", s);
+            return -1;
+        }
+        int len = unit == 'm' ? n : unit == 'h' ? n * 60 : unit == 'd' ? n * 1440 : 0;
+        if (!len || len > ROLLUP_MAXLEN || ROLLUP_MAXLEN % len) {
+            printf("Invalid rollup window \"%s\" (must divide a day)\n", s);
+            return -1;
+        } else if (nwindows == ROLLUP_WINDOWS) {
+            printf("Too many rollup windows (at most %d)\n", ROLLUP_WINDOWS);
+            return -1;
+        }
+        strcpy(windows[nwindows].name, s);
+        windows[nwindows++].len = len;
+    }
+    return 0;
+}
+
+bool rollup_enabled() {
+    return nwindows > 0;
+}
+
+rollup_t *rollup_new() {
+    rollup_t *rollup = calloc(sizeof(rollup_t), 1);
+    rollup->due = INT64_MAX;
+    return rollup;
+}
+
+/**
+ * Return reading_offset() at "minute", in minutes. Only called by the
+ * publisher, so the cache needs no lock.
+ */
+static int64_t standard_offset(int64_t minute) {
+    static int64_t block = -1, offset;
+    if (minute / 15 != block) {
+        block = minute / 15;    // offsets only change on a quarter hour
+        offset = reading_offset(minute * 60) / 60;
+    }
+    return offset;
+}
+
+/**
+ * Return the first minute of the window of "len" minutes that "minute" is in
+ */
+static int64_t window_start(int64_t minute, int len) {
+    int64_t local = minute + standard_offset(minute);
+    return minute - ((local % len) + len) % len;
+}
+
+/**
+ * Publish one window, if it has any readings
+ */
+static void window_publish(rollup_t *rollup, const char *serial, int i, int64_t start, bool late) {
+    int minutes = 0;
+    int32_t min = 0, max = 0;
+    int64_t sum = 0;
+    for (int64_t m=start;m<start+windows[i].len;m++) {
+        uint64_t slot = rollup->slot[m & MASK];
+        if ((int64_t)(slot >> 16) == m) {
+            int32_t watts = reading_watts(slot & 0xFFFF, voltage);
+            if (!minutes || watts < min) {
+                min = watts;
+            }
+            if (!minutes || watts > max) {
+                max = watts;
+            }
+            sum += watts;
+            minutes++;
+        }
+    }
+    if (!minutes) {
+        return;
+    }
+    char topic[200], buf[1024];
+    snprintf(topic, sizeof(topic), "%s/rollup/%s", mqtt_topic, windows[i].name);
+    // sum is watt-minutes, so kWh is sum / 60000
+    int len = snprintf(buf, sizeof(buf), "{\"type\":\"rollup\",\"serial\":\"%s\",\"window\":\"%s\",\"start\":%" PRId64 ",\"end\":%" PRId64 ",\"minutes\":%d,\"kwh\":%.5f,\"watts\":{\"min\":%d,\"mean\":%" PRId64 ",\"max\":%d}%s,\"when\":%" PRIu64 ",\"who\":\"%s\",\"where\":\"%s\"}",
+            serial, windows[i].name, start * 60, (start + windows[i].len) * 60, minutes, sum / 60000.0, min, sum / minutes, max, late ? ",\"late\":true" : "", millis() / 1000, programname, hostname);
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    publish(topic, buf, len);
+    if (debug) {
+        log_print(LOG_DEBUG, "%s %.*s\n", topic, len, buf);
+    }
+}
+
+/**
+ * Publish every dirty window that has closed, or every one if "all" is set
+ */
+static void windows_publish(rollup_t *rollup, const char *serial, bool all) {
+    int64_t clock = rollup->clock;
+    rollup->due = INT64_MAX;
+    for (int i=0;i<nwindows;i++) {
+        for (int w=0;w<WORDS;w++) {
+            uint64_t dirty = rollup->dirty[i][w];
+            while (dirty) {
+                int b = __builtin_ctzll(dirty);
+                dirty &= dirty - 1;
+                // The window started within the last ROLLUP_MINUTES minutes
+                int64_t start = clock - ((clock - (w * 64 + b)) & MASK);
+                if (all || start + windows[i].len <= clock) {
+                    uint64_t bit = 1ULL << b;
+                    window_publish(rollup, serial, i, start, rollup->late[i][w] & bit);
+                    rollup->dirty[i][w] &= ~bit;
+                    rollup->late[i][w] &= ~bit;
+                } else if (start + windows[i].len < rollup->due) {
+                    rollup->due = start + windows[i].len;
+                }
+            }
+        }
+    }
+}
+
+void rollup_flush(rollup_t *rollup, const char *serial) {
+    if (rollup->clock < rollup->due) {
+        return;         // nothing has closed since the last look
+    }
+    windows_publish(rollup, serial, false);
+}
+
+void rollup_add(rollup_t *rollup, const char *serial, const reading_t *reading, bool published) {
+    int64_t minute = reading->unitwhen / 60;
+    if (minute > time(NULL) / 60 + ROLLUP_SLACK) {
+        return;         // a unit clock this far ahead of ours is wrong
+    }
+    if (rollup->clock && (minute <= rollup->clock - HORIZON || minute >= rollup->clock + HORIZON)) {
+        // The unit's clock has been reset or corrected by more than the
+        // slots cover: publish what's pending, and start again from here
+        log_print(LOG_WARN, "ROLLUP: %s: unit clock moved %+" PRId64 " minutes, starting again\n", serial, minute - rollup->clock);
+        windows_publish(rollup, serial, true);
+        memset(rollup, 0, sizeof(rollup_t));
+        rollup->due = INT64_MAX;
+    } else if (minute > rollup->clock && rollup->clock >= rollup->due) {
+        // Publish what has closed before the clock moves on, so every dirty
+        // window left started within a day of it and can still be found
+        windows_publish(rollup, serial, false);
+    }
+    uint64_t slot = (uint64_t)minute << 16 | reading->amps;
+    if (rollup->slot[minute & MASK] != slot) {
+        rollup->slot[minute & MASK] = slot;
+        if (!published) {
+            for (int i=0;i<nwindows;i++) {
+                int64_t start = window_start(minute, windows[i].len);
+                uint64_t bit = 1ULL << (start & 63);
+                uint64_t *dirty = &rollup->dirty[i][(start & MASK) / 64];
+                if (!(*dirty & bit)) {
+                    *dirty |= bit;
+                    if (start + windows[i].len < rollup->due) {
+                        rollup->due = start + windows[i].len;
+                    }
+                    if (start + windows[i].len <= rollup->clock) {
+                        // Closed, and so already published unless it was empty
+                        rollup->late[i][(start & MASK) / 64] |= bit;
+                    }
+                }
+            }
+        }
+    }
+    if (minute > rollup->clock) {
+        rollup->clock = minute;
+    }
+}
+
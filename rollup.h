@@ -0,0 +1,78 @@
+/*
+ * Energy rollups: kWh and min/mean/max watts per device over fixed windows
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * With --rollup 1m,15m,1h,1d (say) the publisher keeps the last
+ * ROLLUP_MINUTES minutes of readings for each meter, one slot per minute,
+ * and publishes a summary of each window to <topic>/rollup/<window> once
+ * it has closed:
+ *
+ *   {"type":"rollup","serial":"...","window":"15m","start":...,"end":...,
+ *    "minutes":15,"kwh":0.08750,"watts":{"min":280,"mean":350,"max":420},
+ *    "late":true,"when":...,"who":"...","where":"..."}
+ *
+ * "start" and "end" are seconds since 1970, "minutes" is how many minutes
+ * of the window had a reading, and "late" is only there when the window
+ * is being published again because history for it arrived after it closed.
+ *
+ * Windows are aligned to local midnight in standard time, which is what
+ * the unit's clock is read as all year round, and must divide a day. A window
+ * closes when a reading for a later minute arrives. A minute reported more
+ * than once counts once, using the latest value, so repeated history
+ * doesn't change a window and isn't published again; history that does
+ * change a closed window republishes it. History is accepted for about
+ * 44 days back.
+ *
+ * A reading more than ROLLUP_SLACK minutes ahead of our own clock is
+ * ignored, as the unit's clock must be wrong. If the unit's clock jumps
+ * further than the slots reach, backwards or forwards, every pending
+ * window is published as it is and the rollups start again from the new
+ * time.
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdbool.h>
+#include "reading.h"
+
+#define ROLLUP_MINUTES  65536       // minutes kept for each meter; a power of two
+#define ROLLUP_WINDOWS  8           // the most windows that can be configured
+#define ROLLUP_MAXLEN   1440        // the longest window, in minutes
+#define ROLLUP_SLACK    1440        // minutes a reading may be ahead of our clock
+
+typedef struct rollup_struct rollup_t;
+
+/**
+ * Set the windows from a comma-separated list like "1m,15m,1h,1d".
+ * Returns 0 on success or -1 if it's invalid, having printed why.
+ */
+int rollup_parse(const char *spec);
+
+/**
+ * Return true if any windows have been set
+ */
+bool rollup_enabled();
+
+/**
+ * Return a new, empty set of rollups for one meter
+ */
+rollup_t *rollup_new();
+
+/**
+ * Add a reading. If "published" is true it's known to have been published
+ * already by an earlier run, so the windows it's in are only updated and
+ * not published again.
+ */
+void rollup_add(rollup_t *rollup, const char *serial, const reading_t *reading, bool published);
+
+/**
+ * Publish every window that has closed since it last changed
+ */
+void rollup_flush(rollup_t *rollup, const char *serial);
+
+#endif
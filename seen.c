@@ -0,0 +1,106 @@
+/*
+ * Index of history already published, kept across restarts - see seen.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "seen.h"
+#include "log.h"
+
+#define SEEN_MAGIC      0x4e454553  // "SEEN"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slots;             // SEEN_SLOTS when the file was made
+    int64_t highwater;          // latest minute published, or 0 for none
+    uint64_t slot[SEEN_SLOTS];  // minute << 16 | amps, or 0 for empty
+} seen_file_t;
+
+struct seen_struct {
+    seen_file_t *map;
+};
+
+seen_t *seen_open(const char *dir, const char *serial) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_print(LOG_ERROR, "ERROR: seen: mkdir \"%s\": %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.seen", dir, serial);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // Allocated rather than sparse, so writing to the map can't raise SIGBUS when the disk is full
+    int r = fd < 0 ? 0 : posix_fallocate(fd, 0, sizeof(seen_file_t));
+    if (r) {
+        errno = r;
+    }
+    seen_file_t *map;
+    if (fd < 0 || r || (map = mmap(NULL, sizeof(seen_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        log_print(LOG_ERROR, "ERROR: seen: \"%s\": %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    close(fd);
+    if (map->magic != SEEN_MAGIC || map->slots != SEEN_SLOTS) {
+        memset(map, 0, sizeof(seen_file_t));
+        map->magic = SEEN_MAGIC;
+        map->slots = SEEN_SLOTS;
+    }
+    if (map->highwater > time(NULL) / 60 + SEEN_SLACK) {
+        map->highwater = time(NULL) / 60 + SEEN_SLACK;    // set by a unit whose clock was wrong
+    }
+    seen_t *seen = calloc(sizeof(seen_t), 1);
+    seen->map = map;
+    return seen;
+}
+
+void seen_close(seen_t *seen) {
+    msync(seen->map, sizeof(seen_file_t), MS_ASYNC);
+    munmap(seen->map, sizeof(seen_file_t));
+    free(seen);
+}
+
+bool seen_check(seen_t *seen, time_t unitwhen, uint16_t amps) {
+    int64_t minute = unitwhen / 60;
+    if (minute <= seen->map->highwater - SEEN_WINDOW) {
+        return true;
+    }
+    // A slot holds its minute, so this is right even after the high-water mark
+    return seen->map->slot[minute & (SEEN_SLOTS - 1)] == ((uint64_t)minute << 16 | amps);
+}
+
+void seen_add(seen_t *seen, time_t unitwhen, uint16_t amps) {
+    int64_t minute = unitwhen / 60;
+    if (minute <= seen->map->highwater - SEEN_WINDOW) {
+        return;
+    }
+    seen->map->slot[minute & (SEEN_SLOTS - 1)] = (uint64_t)minute << 16 | amps;
+    // One frame from a unit with a wild clock mustn't push the mark so far
+    // ahead that the real history behind it is presumed published
+    int64_t limit = time(NULL) / 60 + SEEN_SLACK;
+    if (minute > seen->map->highwater) {
+        seen->map->highwater = minute < limit ? minute : limit;
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Index of history already published, kept across restarts
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * The unit reports its whole history each time it's connected, and
+ * sometimes again unprompted, so with --all the same records would be
+ * published over and over. Each serial has a small mmap'd file under the
+ * state directory recording the (unitwhen, amps) pairs published in the
+ * last SEEN_WINDOW minutes, and the latest minute published - the
+ * high-water mark:
+ *
+ *   - a record more than SEEN_WINDOW minutes before it is presumed to
+ *     have been published already
+ *   - anything else is looked up
+ *
+ * The mark is kept to no more than SEEN_SLACK minutes ahead of our own
+ * clock, so a corrupt frame or a unit set to the wrong year can't leave
+ * genuine history behind it presumed published.
+ *
+ * The lookup is a hash set with one slot per minute, indexed by minute
+ * modulo SEEN_SLOTS. As SEEN_SLOTS is more than SEEN_WINDOW, no two minutes
+ * in the window share a slot, so there are no collisions to resolve and a
+ * lookup or insert is one memory access. A slot holds the minute and the
+ * amps, so a corrected record for a minute (different amps) is new.
+ *
+ * The file is MAP_SHARED, so it's written back by the kernel even if the
+ * program is killed.
+ */
+
+#ifndef SEEN_H
+#define SEEN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define SEEN_SLOTS      65536               // a power of two, more than SEEN_WINDOW
+#define SEEN_WINDOW     (30 * 1440)         // minutes; the unit keeps about a month
+#define SEEN_SLACK      1440                // minutes the high-water mark may be ahead of our clock
+
+typedef struct seen_struct seen_t;
+
+/**
+ * Open (creating if necessary) the index for "serial" in "dir".
+ * Returns NULL on failure, having printed why.
+ */
+seen_t *seen_open(const char *dir, const char *serial);
+
+/**
+ * Sync and close the index
+ */
+void seen_close(seen_t *seen);
+
+/**
+ * Return true if the reading for minute "unitwhen" with "amps" has
+ * already been published
+ */
+bool seen_check(seen_t *seen, time_t unitwhen, uint16_t amps);
+
+/**
+ * Record that the reading for minute "unitwhen" with "amps" has been
+ * published
+ */
+void seen_add(seen_t *seen, time_t unitwhen, uint16_t amps);
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ * Sending readings to outputs other than MQTT - see sink.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "cm160.h"
+#include "sink.h"
+#include "metrics.h"
+#include "log.h"
+
+#define SINK_UDP        0
+#define SINK_UNIX       1
+#define SINK_FILE       2
+
+#define MAXCLIENTS      16          // connected to a unix sink at once
+#define DATAGRAM        1472        // the most bytes in a UDP datagram, to fit an Ethernet frame
+
+typedef struct {
+    uint16_t len;
+    char data[FORMAT_MAX + 1];      // the reading and its newline
+} message_t;
+
+typedef struct sink_struct {
+    int type;
+    char target[200];
+    int queue, batch, linger;       // readings, readings, ms
+    bool block;
+    int ttl;
+    off_t maxsize;
+    int keep;
+
+    int fd;                         // socket or file, or -1
+    struct sockaddr_in addr;        // udp
+    int clients[MAXCLIENTS];        // unix; -1 for none
+    off_t size;                     // file
+
+    message_t *ring;                // "queue" long; a power of two
+    uint32_t head, tail;            // free-running; head written by the publisher, tail by the sink
+    uint64_t dropped;               // written by the publisher, read by metrics
+    char *buf;                      // a batch being sent
+    pthread_t thread;
+    sem_t wakeup;
+    int wakeup_pending;
+    volatile bool running;
+    struct sink_struct *next;
+} sink_t;
+
+static sink_t *sinks;
+
+int sink_parse(const char *spec) {
+    sink_t *sink = calloc(sizeof(sink_t), 1);
+    if (!sink) {
+        printf("Can't allocate sink \"%s\"\n", spec);
+        return -1;
+    }
+    sink->queue = 1024;
+    sink->batch = 64;
+    sink->ttl = 1;
+    sink->maxsize = 16 * 1024 * 1024;
+    sink->keep = 5;
+    sink->fd = -1;
+    char buf[300];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    char *save, *s = strtok_r(buf, ",", &save);
+    if (s && !strncmp(s, "udp:", 4)) {
+        sink->type = SINK_UDP;
+        char *port = strrchr(s + 4, ':');
+        if (port) {
+            *port++ = 0;
+        }
+        sink->addr.sin_family = AF_INET;
+        if (!port || inet_pton(AF_INET, s + 4, &sink->addr.sin_addr) != 1 || atoi(port) <= 0 || atoi(port) > 65535) {
+            printf("Invalid sink \"%s\" (udp:<address>:<port>)\n", spec);
+            free(sink);
+            return -1;
+        }
+        sink->addr.sin_port = htons(atoi(port));
+        snprintf(sink->target, sizeof(sink->target), "udp:%s:%s", s + 4, port);
+    } else if (s && !strncmp(s, "unix:", 5) && s[5] && strlen(s + 5) < sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        sink->type = SINK_UNIX;
+        strncpy(sink->target, s, sizeof(sink->target) - 1);
+    } else if (s && !strncmp(s, "file:", 5) && s[5]) {
+        sink->type = SINK_FILE;
+        strncpy(sink->target, s, sizeof(sink->target) - 1);
+    } else {
+        printf("Invalid sink \"%s\" (udp:<address>:<port>, unix:<path> or file:<path>)\n", spec);
+        free(sink);
+        return -1;
+    }
+    while ((s = strtok_r(NULL, ",", &save))) {
+        char *value = strchr(s, '=');
+        int v = value ? atoi(value + 1) : 0;
+        if (value && !strncmp(s, "queue=", 6) && v > 0 && !(v & (v - 1))) {
+            sink->queue = v;
+        } else if (value && !strncmp(s, "batch=", 6) && v > 0) {
+            sink->batch = v;
+        } else if (value && !strncmp(s, "ms=", 3) && v >= 0) {
+            sink->linger = v;
+        } else if (!strcmp(s, "policy=drop") || !strcmp(s, "policy=block")) {
+            sink->block = !strcmp(s, "policy=block");
+        } else if (value && !strncmp(s, "ttl=", 4) && sink->type == SINK_UDP && v > 0 && v < 256) {
+            sink->ttl = v;
+        } else if (value && !strncmp(s, "size=", 5) && sink->type == SINK_FILE && v > 0) {
+            sink->maxsize = (off_t)v * 1024 * 1024;
+        } else if (value && !strncmp(s, "keep=", 5) && sink->type == SINK_FILE && v >= 0) {
+            sink->keep = v;
+        } else {
+            printf("Invalid sink option \"%s\" (queue must be a power of two)\n", s);
+            free(sink);
+            return -1;
+        }
+    }
+    // Appended, so sinks are listed in the order they were given
+    sink_t **last = &sinks;
+    while (*last) {
+        last = &(*last)->next;
+    }
+    *last = sink;
+    return 0;
+}
+
+static const char *sink_path(const sink_t *sink) {
+    return strchr(sink->target, ':') + 1;
+}
+
+/**
+ * Open the sink's file, socket or listening socket
+ */
+static int sink_open(sink_t *sink) {
+    const char *path = sink_path(sink);
+    if (sink->type == SINK_UDP) {
+        unsigned char ttl = sink->ttl;
+        if ((sink->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || setsockopt(sink->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+            return -1;
+        }
+    } else if (sink->type == SINK_UNIX) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if ((sink->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 || bind(sink->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sink->fd, 8) < 0) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+            return -1;
+        }
+        for (int i=0;i<MAXCLIENTS;i++) {
+            sink->clients[i] = -1;
+        }
+    } else {
+        struct stat st;
+        if ((sink->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(sink->fd, &st) < 0) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+            return -1;
+        }
+        sink->size = st.st_size;
+    }
+    return 0;
+}
+
+/**
+ * Rename the sink's file to <path>.1, moving older ones up and deleting
+ * the oldest, and start a new one
+ */
+static void file_rotate(sink_t *sink) {
+    const char *path = sink_path(sink);
+    char from[PATH_MAX], to[PATH_MAX];
+    close(sink->fd);
+    for (int i=sink->keep;i>0;i--) {
+        snprintf(from, sizeof(from), i > 1 ? "%s.%d" : "%s", path, i - 1);
+        snprintf(to, sizeof(to), "%s.%d", path, i);
+        rename(from, to);
+    }
+    if (!sink->keep) {
+        unlink(path);
+    }
+    if ((sink->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+    }
+    sink->size = 0;
+}
+
+/**
+ * Accept any new connections to a unix sink
+ */
+static void unix_accept(sink_t *sink) {
+    int fd;
+    while ((fd = accept4(sink->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int i = 0;
+        while (i < MAXCLIENTS && sink->clients[i] >= 0) {
+            i++;
+        }
+        if (i == MAXCLIENTS) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: too many clients\n", sink->target);
+            close(fd);
+        } else {
+            sink->clients[i] = fd;
+        }
+    }
+}
+
+/**
+ * Send "len" bytes of whole readings
+ */
+static void sink_send(sink_t *sink, const char *buf, int len) {
+    if (sink->type == SINK_UDP) {
+        if (sendto(sink->fd, buf, len, 0, (struct sockaddr *)&sink->addr, sizeof(sink->addr)) < 0) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+        }
+    } else if (sink->type == SINK_UNIX) {
+        for (int i=0;i<MAXCLIENTS;i++) {
+            // A partial write would leave a client with half a reading, so one that can't take it all goes
+            if (sink->clients[i] >= 0 && send(sink->clients[i], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+                close(sink->clients[i]);
+                sink->clients[i] = -1;
+            }
+        }
+    } else if (sink->fd >= 0) {
+        if (sink->size && sink->size + len > sink->maxsize) {
+            file_rotate(sink);
+        }
+        if (sink->fd >= 0 && write(sink->fd, buf, len) != len) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: %s\n", sink->target, strerror(errno));
+        }
+        sink->size += len;
+    }
+}
+
+/**
+ * Send up to a batch of readings from the queue, returning how many
+ */
+static int sink_drain(sink_t *sink) {
+    uint32_t tail = sink->tail, head = __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE);
+    int count = 0, len = 0;
+    int max = sink->type == SINK_UDP ? DATAGRAM : sink->batch * (FORMAT_MAX + 1);
+    while (tail != head && count < sink->batch) {
+        const message_t *m = &sink->ring[tail & (sink->queue - 1)];
+        if (len && len + m->len > max) {
+            break;
+        }
+        memcpy(sink->buf + len, m->data, m->len);
+        len += m->len;
+        count++;
+        __atomic_store_n(&sink->tail, ++tail, __ATOMIC_RELEASE);
+    }
+    if (len) {
+        sink_send(sink, sink->buf, len);
+    }
+    return count;
+}
+
+static void *sink_run(void *arg) {
+    sink_t *sink = arg;
+    for (;;) {
+        __atomic_store_n(&sink->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+        if (sink->type == SINK_UNIX) {
+            unix_accept(sink);
+        }
+        uint32_t queued = __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE) - sink->tail;
+        if (queued && queued < sink->batch && sink->linger && sink->running) {
+            // Give the batch a chance to fill
+            usleep(sink->linger * 1000);
+        }
+        while (sink_drain(sink)) {
+        }
+        if (!sink->running && __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE) == sink->tail) {
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        sem_timedwait(&sink->wakeup, &ts);
+    }
+    return NULL;
+}
+
+int sink_start() {
+    for (sink_t *sink=sinks;sink;sink=sink->next) {
+        if (sink_open(sink)) {
+            return -1;
+        }
+        sink->ring = malloc(sizeof(message_t) * (size_t)sink->queue);
+        sink->buf = malloc(sink->type == SINK_UDP ? DATAGRAM : (size_t)sink->batch * (FORMAT_MAX + 1));
+        if (!sink->ring || !sink->buf) {
+            log_print(LOG_ERROR, "ERROR: sink: %s: can't allocate a queue of %d and batch of %d\n", sink->target, sink->queue, sink->batch);
+            return -1;
+        }
+        sem_init(&sink->wakeup, 0, 0);
+        sink->running = true;
+        int r;
+        if ((r=thread_start(&sink->thread, sink_run, sink))) {
+            log_print(LOG_ERROR, "ERROR: pthread_create returned %d (%s)\n", r, strerror(r));
+            sink->running = false;
+        }
+        if (r) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sink_write(const void *buf, int len) {
+    bool newline = format_text(output_format);
+    for (sink_t *sink=sinks;sink;sink=sink->next) {
+        if (!sink->running) {
+            continue;
+        }
+        uint32_t head = sink->head;
+        while (head - __atomic_load_n(&sink->tail, __ATOMIC_ACQUIRE) == sink->queue) {
+            if (!sink->block) {
+                METRIC_INC(sink->dropped);
+                uint64_t dropped = sink->dropped;
+                if (!(dropped & (dropped - 1))) {
+                    log_print(LOG_ERROR, "ERROR: sink: %s is behind, %" PRIu64 " readings dropped\n", sink->target, dropped);
+                }
+                break;
+            }
+            usleep(1000);
+        }
+        if (head - sink->tail == sink->queue) {
+            continue;
+        }
+        message_t *m = &sink->ring[head & (sink->queue - 1)];
+        memcpy(m->data, buf, len);
+        m->len = len;
+        if (newline) {
+            m->data[m->len++] = '\n';
+        }
+        __atomic_store_n(&sink->head, head + 1, __ATOMIC_RELEASE);
+        if (!__atomic_exchange_n(&sink->wakeup_pending, 1, __ATOMIC_SEQ_CST)) {
+            sem_post(&sink->wakeup);
+        }
+    }
+}
+
+const char *sink_dropped(int i, uint64_t *dropped) {
+    sink_t *sink = sinks;
+    while (sink && i--) {
+        sink = sink->next;
+    }
+    if (!sink) {
+        return NULL;
+    }
+    *dropped = __atomic_load_n(&sink->dropped, __ATOMIC_RELAXED);
+    return sink->target;
+}
+
+void sink_stop() {
+    for (sink_t *sink=sinks;sink;sink=sink->next) {
+        if (sink->running) {
+            sink->running = false;
+            sem_post(&sink->wakeup);
+            pthread_join(sink->thread, NULL);
+            sem_destroy(&sink->wakeup);
+        }
+        if (sink->type == SINK_UNIX) {
+            for (int i=0;i<MAXCLIENTS;i++) {
+                if (sink->clients[i] >= 0) {
+                    close(sink->clients[i]);
+                }
+            }
+            if (sink->fd >= 0) {
+                unlink(sink_path(sink));
+            }
+        }
+        if (sink->fd >= 0) {
+            close(sink->fd);
+            sink->fd = -1;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Sending readings to outputs other than MQTT
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Each --sink is given every reading the publisher publishes to MQTT,
+ * serialised the same way (--format), followed by a newline if the format
+ * is text. The kinds are
+ *
+ *   udp:<address>:<port>       datagrams to a host or multicast group,
+ *                              packing as many readings into each as fit
+ *   unix:<path>                a stream socket that any number of local
+ *                              consumers can connect to; one too slow to
+ *                              take what it's sent is disconnected
+ *   file:<path>                appended to a file, which is rotated to
+ *                              <path>.1, <path>.2 ... when it gets too big
+ *
+ * followed by any of these options, comma-separated:
+ *
+ *   queue=<readings>           the size of its queue (default: 1024)
+ *   batch=<readings>           the most readings sent in one go (default: 64)
+ *   ms=<ms>                    how long to wait for a batch to fill (default: 0)
+ *   policy=drop|block          when its queue is full, drop the reading or
+ *                              make the publisher wait (default: drop)
+ *   ttl=<hops>                 udp: the multicast TTL (default: 1)
+ *   size=<mb>, keep=<files>    file: rotate at this size, keeping this many
+ *                              old files (default: 16 and 5)
+ *
+ * Each sink has a thread and a queue of its own, with the publisher as its
+ * only producer, so a sink that falls behind only fills its own queue. The
+ * USB reader never waits on a sink, even with policy=block: that holds up
+ * the publisher, and the reader drops readings once the meter's queue is
+ * full, as it would for a slow broker.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+
+/**
+ * Add a sink from a --sink option like "udp:239.0.0.1:5000,batch=16".
+ * Returns 0 on success or -1 if it's invalid, having printed why.
+ */
+int sink_parse(const char *spec);
+
+/**
+ * Open every sink and start its thread. Returns 0 on success or -1 on
+ * failure, having printed why.
+ */
+int sink_start();
+
+/**
+ * Queue a serialised reading for every sink. Only called by the publisher.
+ */
+void sink_write(const void *buf, int len);
+
+/**
+ * Return the target of the "i"th sink, setting "dropped" to the readings
+ * it has dropped because its queue was full, or NULL if there are fewer
+ * sinks. Can be called from any thread.
+ */
+const char *sink_dropped(int i, uint64_t *dropped);
+
+/**
+ * Send what's queued and stop every sink
+ */
+void sink_stop();
+
+#endif
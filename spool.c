@@ -0,0 +1,384 @@
+/*
+ * On-disk store-and-forward queue for MQTT messages - see spool.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+#include "log.h"
+
+#define SEGMENT_SIZE    (1024 * 1024)             // see SPOOL_MESSAGE_MAX
+#define RECORD_MAGIC    0xC160
+#define SPOOL_MAGIC     0x6c6f6f7073303631ULL       // "160spool"
+
+// Each record is this header, the NUL-terminated topic, then the payload,
+// padded to a multiple of 8 bytes. A zero size marks the end of a segment.
+typedef struct {
+    uint32_t size;              // whole record including padding
+    uint32_t len;               // payload length
+    uint16_t topiclen;          // including the NUL
+    uint16_t magic;
+    uint32_t reserved;
+} record_t;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t committed;
+} checkpoint_t;
+
+struct spool_struct {
+    char dir[PATH_MAX - 32];
+    uint64_t maxsegs;
+    uint64_t first;             // oldest segment on disk
+    uint64_t rpos, wpos;
+    uint64_t rseg, wseg;        // segments mapped at rmap and wmap
+    uint8_t *rmap, *wmap;
+    checkpoint_t *checkpoint;
+    uint64_t pending, dropped;
+};
+
+/**
+ * Map segment "seg", creating it with all its blocks allocated if "create"
+ * is set: a sparse file would raise SIGBUS on the first write to an
+ * unallocated page once the disk filled. Returns NULL on failure, having
+ * printed why, with errno set (ENOSPC if the disk is full).
+ */
+static uint8_t *segment_map(spool_t *spool, uint64_t seg, bool create) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".seg", spool->dir, seg);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        if (create || errno != ENOENT) {
+            log_print(LOG_ERROR, "ERROR: spool: open \"%s\": %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+    uint8_t *map = NULL;
+    struct stat st;
+    int r = 0;
+    if (create && (fstat(fd, &st) < 0 || st.st_size < SEGMENT_SIZE) && (r = posix_fallocate(fd, 0, SEGMENT_SIZE))) {
+        log_print(LOG_ERROR, "ERROR: spool: posix_fallocate \"%s\": %s\n", path, strerror(r));
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            unlink(path);       // just made, and empty
+        }
+    } else if ((map = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        r = errno;
+        log_print(LOG_ERROR, "ERROR: spool: mmap \"%s\": %s\n", path, strerror(r));
+        map = NULL;
+    }
+    close(fd);
+    errno = r;
+    return map;
+}
+
+static void segment_unlink(spool_t *spool, uint64_t seg) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".seg", spool->dir, seg);
+    unlink(path);
+}
+
+/**
+ * Map segment "seg" for reading, reusing the write mapping if it's the same one.
+ * A segment that has gone missing reads as empty.
+ */
+static const uint8_t *segment_read(spool_t *spool, uint64_t seg) {
+    if (seg == spool->wseg) {
+        return spool->wmap;
+    }
+    if (spool->rmap && spool->rseg == seg) {
+        return spool->rmap;
+    }
+    if (spool->rmap) {
+        munmap(spool->rmap, SEGMENT_SIZE);
+    }
+    spool->rmap = segment_map(spool, seg, false);
+    spool->rseg = seg;
+    return spool->rmap;
+}
+
+/**
+ * Return the record at the read cursor, skipping to the next segment at the
+ * end of each one, or NULL if there's nothing left to read.
+ */
+static const record_t *spool_record(spool_t *spool) {
+    while (spool->rpos < spool->wpos) {
+        uint64_t seg = spool->rpos / SEGMENT_SIZE;
+        uint32_t off = spool->rpos % SEGMENT_SIZE;
+        const uint8_t *map = segment_read(spool, seg);
+        const record_t *record = map && off + sizeof(record_t) <= SEGMENT_SIZE ? (const record_t *)(map + off) : NULL;
+        if (record && record->size && record->magic == RECORD_MAGIC && off + record->size <= SEGMENT_SIZE) {
+            return record;
+        }
+        spool->rpos = (seg + 1) * SEGMENT_SIZE;
+    }
+    spool->rpos = spool->wpos;
+    return NULL;
+}
+
+/**
+ * Count the records from the read cursor up to "to", leaving the cursor at "to"
+ */
+static uint64_t spool_skip(spool_t *spool, uint64_t to) {
+    uint64_t count = 0;
+    const record_t *record;
+    while (spool->rpos < to && (record = spool_record(spool))) {
+        spool->rpos += record->size;
+        count++;
+    }
+    if (spool->rpos < to) {
+        spool->rpos = to;
+    }
+    return count;
+}
+
+spool_t *spool_open(const char *dir, size_t maxbytes) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_print(LOG_ERROR, "ERROR: spool: mkdir \"%s\": %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    spool_t *spool = calloc(sizeof(spool_t), 1);
+    strncpy(spool->dir, dir, sizeof(spool->dir) - 1);
+    spool->maxsegs = maxbytes / SEGMENT_SIZE;
+    if (spool->maxsegs < 2) {
+        spool->maxsegs = 2;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/checkpoint", spool->dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    int r = fd < 0 ? 0 : posix_fallocate(fd, 0, sizeof(checkpoint_t));
+    if (r) {
+        errno = r;
+    }
+    if (fd < 0 || r || (spool->checkpoint = mmap(NULL, sizeof(checkpoint_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        log_print(LOG_ERROR, "ERROR: spool: checkpoint \"%s\": %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(spool);
+        return NULL;
+    }
+    close(fd);
+    if (spool->checkpoint->magic != SPOOL_MAGIC) {
+        spool->checkpoint->magic = SPOOL_MAGIC;
+        spool->checkpoint->committed = 0;
+    }
+
+    // Find the oldest and newest segments
+    uint64_t first = UINT64_MAX, last = 0;
+    DIR *d = opendir(spool->dir);
+    struct dirent *e;
+    while (d && (e = readdir(d))) {
+        uint64_t seg;
+        char tail;
+        if (strlen(e->d_name) == 20 && sscanf(e->d_name, "%16" SCNx64 ".se%c", &seg, &tail) == 2 && tail == 'g') {
+            if (seg < first) {
+                first = seg;
+            }
+            if (seg > last) {
+                last = seg;
+            }
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    uint64_t committed = spool->checkpoint->committed;
+    if (first == UINT64_MAX) {
+        first = last = committed / SEGMENT_SIZE;
+    }
+    if (committed < first * SEGMENT_SIZE) {
+        committed = first * SEGMENT_SIZE;          // older segments were dropped
+    }
+    for (;first < committed / SEGMENT_SIZE && first < last;first++) {
+        segment_unlink(spool, first);
+    }
+    spool->first = first;
+    spool->wseg = last;
+    if (!(spool->wmap = segment_map(spool, last, true))) {
+        munmap(spool->checkpoint, sizeof(checkpoint_t));
+        free(spool);
+        return NULL;
+    }
+    // The write position is the end of the last complete record in the newest segment
+    uint32_t off = 0;
+    while (off + sizeof(record_t) <= SEGMENT_SIZE) {
+        const record_t *record = (const record_t *)(spool->wmap + off);
+        if (!record->size || record->magic != RECORD_MAGIC || off + record->size > SEGMENT_SIZE) {
+            break;
+        }
+        off += record->size;
+    }
+    spool->wpos = last * SEGMENT_SIZE + off;
+    if (committed > spool->wpos) {
+        committed = spool->wpos;
+    }
+    spool->checkpoint->committed = committed;
+    spool->rpos = committed;
+    spool->pending = spool_skip(spool, spool->wpos);
+    spool->rpos = committed;
+    return spool;
+}
+
+void spool_close(spool_t *spool) {
+    spool_sync(spool);
+    if (spool->rmap) {
+        munmap(spool->rmap, SEGMENT_SIZE);
+    }
+    munmap(spool->wmap, SEGMENT_SIZE);
+    munmap(spool->checkpoint, sizeof(checkpoint_t));
+    free(spool);
+}
+
+/**
+ * Delete the oldest segment, whether it has been sent or not
+ */
+static void spool_drop(spool_t *spool) {
+    uint64_t end = (spool->first + 1) * SEGMENT_SIZE;
+    if (spool->rpos < end) {
+        uint64_t dropped = spool_skip(spool, end);
+        spool->pending -= dropped;
+        spool->dropped += dropped;
+        log_print(LOG_ERROR, "ERROR: spool: full, dropped %" PRIu64 " unsent messages\n", dropped);
+    }
+    if (spool->checkpoint->committed < end) {
+        spool->checkpoint->committed = end;
+    }
+    if (spool->rmap && spool->rseg == spool->first) {
+        munmap(spool->rmap, SEGMENT_SIZE);
+        spool->rmap = NULL;
+    }
+    segment_unlink(spool, spool->first++);
+}
+
+/**
+ * Start a new segment for writing, dropping the oldest if we're at the
+ * limit, or if the disk is full and there's one to drop. A message that
+ * can't be stored because the disk is full counts as dropped too.
+ */
+static int spool_roll(spool_t *spool) {
+    uint64_t seg = spool->wseg + 1;
+    if (seg - spool->first + 1 > spool->maxsegs) {
+        spool_drop(spool);
+    }
+    uint8_t *map;
+    while (!(map = segment_map(spool, seg, true))) {
+        if (errno != ENOSPC) {
+            return -1;
+        } else if (spool->first == spool->wseg) {
+            spool->dropped++;
+            return -1;
+        }
+        spool_drop(spool);
+    }
+    msync(spool->wmap, SEGMENT_SIZE, MS_ASYNC);
+    munmap(spool->wmap, SEGMENT_SIZE);
+    spool->wmap = map;
+    spool->wseg = seg;
+    spool->wpos = seg * SEGMENT_SIZE;
+    return 0;
+}
+
+int spool_append(spool_t *spool, const char *topic, const void *payload, int len) {
+    uint16_t topiclen = strlen(topic) + 1;
+    uint32_t size = (sizeof(record_t) + topiclen + len + 7) & ~7;
+    if (size > SEGMENT_SIZE) {
+        return -1;
+    }
+    // A record that exactly filled the last segment leaves wpos at the start of the next
+    bool full = spool->wpos / SEGMENT_SIZE != spool->wseg || spool->wpos % SEGMENT_SIZE + size > SEGMENT_SIZE;
+    if (full && spool_roll(spool) < 0) {
+        return -1;
+    }
+    record_t *record = (record_t *)(spool->wmap + spool->wpos % SEGMENT_SIZE);
+    memcpy((uint8_t *)(record + 1), topic, topiclen);
+    memcpy((uint8_t *)(record + 1) + topiclen, payload, len);
+    record->len = len;
+    record->topiclen = topiclen;
+    record->magic = RECORD_MAGIC;
+    // size goes last, so a record only exists once it's complete
+    __atomic_store_n(&record->size, size, __ATOMIC_RELEASE);
+    spool->wpos += size;
+    spool->pending++;
+    return 0;
+}
+
+int spool_peek(spool_t *spool, const char **topic, const void **payload, int *len) {
+    const record_t *record = spool_record(spool);
+    if (!record) {
+        return -1;
+    }
+    *topic = (const char *)(record + 1);
+    *payload = (const uint8_t *)(record + 1) + record->topiclen;
+    *len = record->len;
+    return 0;
+}
+
+uint64_t spool_next(spool_t *spool) {
+    const record_t *record = spool_record(spool);
+    if (record) {
+        spool->rpos += record->size;
+        spool->pending--;
+    }
+    return spool->rpos;
+}
+
+void spool_commit(spool_t *spool, uint64_t position) {
+    if (position <= spool->checkpoint->committed) {
+        return;
+    }
+    spool->checkpoint->committed = position;
+    uint64_t seg = position / SEGMENT_SIZE;
+    for (;spool->first < seg && spool->first < spool->wseg;spool->first++) {
+        if (spool->rmap && spool->rseg == spool->first) {
+            munmap(spool->rmap, SEGMENT_SIZE);
+            spool->rmap = NULL;
+        }
+        segment_unlink(spool, spool->first);
+    }
+}
+
+void spool_rewind(spool_t *spool) {
+    uint64_t rpos = spool->rpos;
+    spool->rpos = spool->checkpoint->committed;
+    spool->pending += spool_skip(spool, rpos);
+    spool->rpos = spool->checkpoint->committed;
+}
+
+void spool_sync(spool_t *spool) {
+    msync(spool->wmap, SEGMENT_SIZE, MS_ASYNC);
+    msync(spool->checkpoint, sizeof(checkpoint_t), MS_ASYNC);
+}
+
+uint64_t spool_pending(spool_t *spool) {
+    return spool->pending;
+}
+
+uint64_t spool_dropped(spool_t *spool) {
+    return spool->dropped;
+}
@@ -0,0 +1,87 @@
+/*
+ * On-disk store-and-forward queue for MQTT messages.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Messages are appended to fixed-size segment files in a directory, each
+ * mmap'd so appending is a memcpy and never blocks on the disk. A consumer
+ * reads them back in order and commits its position once the broker has
+ * acknowledged them; the committed position is kept in a small mmap'd
+ * checkpoint file, so after a restart only unacknowledged messages are sent
+ * again. Segments wholly before the committed position are deleted.
+ *
+ * Disk usage is bounded: when a new segment would take the queue past its
+ * limit, the oldest segment is deleted whether it has been sent or not
+ * (drop-oldest), so a long outage loses the oldest readings, not the newest.
+ * Segments are allocated in full when they're made, and if the disk fills
+ * first the oldest are dropped in the same way.
+ *
+ * Positions are byte offsets into the notional concatenation of all
+ * segments, so they only ever increase.
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPOOL_MESSAGE_MAX   (1024 * 1024 - 1024)    // the longest payload a segment is sure to hold with its topic
+
+typedef struct spool_struct spool_t;
+
+/**
+ * Open (creating if necessary) the queue in "dir", using at most "maxbytes"
+ * of disk. Returns NULL on failure, having printed why.
+ */
+spool_t *spool_open(const char *dir, size_t maxbytes);
+
+/**
+ * Sync and close the queue.
+ */
+void spool_close(spool_t *spool);
+
+/**
+ * Append a message. Returns 0 on success, -1 if it couldn't be stored.
+ */
+int spool_append(spool_t *spool, const char *topic, const void *payload, int len);
+
+/**
+ * Return the next message after the read cursor without moving it.
+ * Returns 0 if there is one, or -1 if the cursor has reached the end.
+ */
+int spool_peek(spool_t *spool, const char **topic, const void **payload, int *len);
+
+/**
+ * Move the read cursor past the message returned by spool_peek, and
+ * return the position after it - the value to commit once it's delivered.
+ */
+uint64_t spool_next(spool_t *spool);
+
+/**
+ * Record that everything before "position" has been delivered.
+ */
+void spool_commit(spool_t *spool, uint64_t position);
+
+/**
+ * Move the read cursor back to the committed position, so anything sent
+ * but not acknowledged is sent again.
+ */
+void spool_rewind(spool_t *spool);
+
+/**
+ * Flush the segments and checkpoint to disk without waiting for it to finish.
+ */
+void spool_sync(spool_t *spool);
+
+/**
+ * Return the number of messages waiting to be read, and the number dropped
+ * because the queue was full.
+ */
+uint64_t spool_pending(spool_t *spool);
+uint64_t spool_dropped(spool_t *spool);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Local time-series store for CM160 readings - see store.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "reading.h"
+#include "store.h"
+#include "log.h"
+
+#define MINUTES_PER_DAY 1440
+
+// One per day in each serial's index file
+typedef struct {
+    uint32_t day;               // days since the epoch
+    uint32_t count;
+    uint16_t first, last;       // earliest and latest minute of the day seen
+} index_t;
+
+typedef struct partition_struct {
+    char serial[80];
+    int min, amp, flg;          // column file descriptors, or -1
+    int index;                  // index file descriptor
+    off_t indexoff;             // where this day's entry is in it
+    index_t entry;
+    bool dirty;
+    time_t flushed;
+    struct partition_struct *next;
+} partition_t;
+
+struct store_struct {
+    char dir[PATH_MAX - 200];
+    partition_t *partitions;
+};
+
+store_t *store_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_print(LOG_ERROR, "ERROR: store: mkdir \"%s\": %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    store_t *store = calloc(sizeof(store_t), 1);
+    strncpy(store->dir, dir, sizeof(store->dir) - 1);
+    return store;
+}
+
+static void partition_flush(partition_t *p) {
+    if (p->dirty && pwrite(p->index, &p->entry, sizeof(index_t), p->indexoff) != sizeof(index_t)) {
+        log_print(LOG_ERROR, "ERROR: store: index for \"%s\": %s\n", p->serial, strerror(errno));
+    }
+    p->dirty = false;
+}
+
+static void partition_close(partition_t *p) {
+    partition_flush(p);
+    if (p->min >= 0) {
+        close(p->min);
+        close(p->amp);
+        close(p->flg);
+    }
+    p->min = p->amp = p->flg = -1;
+}
+
+void store_close(store_t *store) {
+    partition_t *next;
+    for (partition_t *p=store->partitions;p;p=next) {
+        next = p->next;
+        partition_close(p);
+        close(p->index);
+        free(p);
+    }
+    free(store);
+}
+
+static int column_open(store_t *store, const char *serial, uint32_t day, const char *column) {
+    char path[PATH_MAX];
+    time_t t = (time_t)day * 86400;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(path, sizeof(path), "%s/%s/%04d%02d%02d.%s", store->dir, serial, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, column);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_print(LOG_ERROR, "ERROR: store: open \"%s\": %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Return the partition for "serial", switched to "day"
+ */
+static partition_t *partition_get(store_t *store, const char *serial, uint32_t day) {
+    partition_t *p;
+    for (p=store->partitions;p;p=p->next) {
+        if (!strcmp(p->serial, serial)) {
+            break;
+        }
+    }
+    if (!p) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", store->dir, serial);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            log_print(LOG_ERROR, "ERROR: store: mkdir \"%s\": %s\n", path, strerror(errno));
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/%s/index", store->dir, serial);
+        int index = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (index < 0) {
+            log_print(LOG_ERROR, "ERROR: store: open \"%s\": %s\n", path, strerror(errno));
+            return NULL;
+        }
+        p = calloc(sizeof(partition_t), 1);
+        strncpy(p->serial, serial, sizeof(p->serial) - 1);
+        p->index = index;
+        p->min = p->amp = p->flg = -1;
+        p->next = store->partitions;
+        store->partitions = p;
+    }
+    if (p->min >= 0 && p->entry.day == day) {
+        return p;
+    }
+    partition_close(p);
+    // Find this day's index entry, searching from the end as it's probably recent
+    off_t size = lseek(p->index, 0, SEEK_END);
+    size -= size % sizeof(index_t);
+    p->indexoff = size;
+    memset(&p->entry, 0, sizeof(index_t));
+    for (off_t off=size - sizeof(index_t);off>=0;off-=sizeof(index_t)) {
+        index_t entry;
+        if (pread(p->index, &entry, sizeof(entry), off) == sizeof(entry) && entry.day == day) {
+            p->indexoff = off;
+            p->entry = entry;
+            break;
+        }
+    }
+    if (p->indexoff == size) {
+        p->entry.day = day;
+        p->entry.first = MINUTES_PER_DAY;
+    }
+    p->min = column_open(store, serial, day, "min");
+    p->amp = column_open(store, serial, day, "amp");
+    p->flg = column_open(store, serial, day, "flg");
+    if (p->min < 0 || p->amp < 0 || p->flg < 0) {
+        if (p->min >= 0) close(p->min);
+        if (p->amp >= 0) close(p->amp);
+        if (p->flg >= 0) close(p->flg);
+        p->min = p->amp = p->flg = -1;
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * After a failed append, cut the columns back to the shortest, so a record
+ * written to some of them but not all can't leave the rest misaligned
+ */
+static void partition_align(partition_t *p) {
+    struct stat st;
+    off_t count = -1;
+    const int fds[3] = { p->min, p->amp, p->flg };
+    const off_t widths[3] = { sizeof(uint16_t), sizeof(uint16_t), sizeof(uint8_t) };
+    for (int i=0;i<3;i++) {
+        if (fstat(fds[i], &st) < 0) {
+            return;
+        }
+        if (count < 0 || st.st_size / widths[i] < count) {
+            count = st.st_size / widths[i];
+        }
+    }
+    for (int i=0;i<3;i++) {
+        if (ftruncate(fds[i], count * widths[i]) < 0) {
+            log_print(LOG_ERROR, "ERROR: store: ftruncate: %s\n", strerror(errno));
+        }
+    }
+}
+
+int store_append(store_t *store, const char *serial, time_t when, uint16_t amps, uint8_t flags) {
+    if (when < 0) {
+        return -1;
+    }
+    uint32_t day = when / 86400;
+    uint16_t minute = (when % 86400) / 60;
+    partition_t *p = partition_get(store, serial, day);
+    if (!p) {
+        return -1;
+    }
+    if (write(p->min, &minute, sizeof(minute)) != sizeof(minute) || write(p->amp, &amps, sizeof(amps)) != sizeof(amps) || write(p->flg, &flags, sizeof(flags)) != sizeof(flags)) {
+        log_print(LOG_ERROR, "ERROR: store: write for \"%s\": %s\n", serial, strerror(errno));
+        partition_align(p);
+        return -1;
+    }
+    p->entry.count++;
+    if (minute < p->entry.first) {
+        p->entry.first = minute;
+    }
+    if (minute > p->entry.last) {
+        p->entry.last = minute;
+    }
+    p->dirty = true;
+    // The index is only a hint - queries use it to pick the days to read, then
+    // read each day's columns up to the shortest - so it needn't be written every time
+    time_t now = time(NULL);
+    if (now != p->flushed) {
+        partition_flush(p);
+        p->flushed = now;
+    }
+    return 0;
+}
+
+/**
+ * Map a whole column file read-only, returning the number of values in it
+ */
+static size_t column_map(const char *path, size_t width, const void **map) {
+    *map = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    size_t count = 0;
+    if (!fstat(fd, &st) && st.st_size >= (off_t)width) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+            *map = m;
+            count = st.st_size / width;
+        }
+    }
+    close(fd);
+    return count;
+}
+
+typedef struct {
+    time_t start;
+    uint32_t minutes;
+    uint64_t amps;              // raw amps summed over the minutes
+    uint16_t min, max;
+} group_t;
+
+static void group_print(const char *serial, const group_t *g, int voltage) {
+    if (g->minutes) {
+        double watts = 0.07 * voltage;
+        printf("{\"serial\":\"%s\",\"from\":%ld,\"minutes\":%u,\"kwh\":%.3f,\"min\":%d,\"mean\":%d,\"max\":%d}\n",
+            serial, (long)g->start, g->minutes, g->amps * watts / 60000, (int)(g->min * watts), (int)(g->amps * watts / g->minutes), (int)(g->max * watts));
+    }
+}
+
+static int query_serial(const char *dir, const char *serial, time_t from, time_t to, int group, int voltage) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/index", dir, serial);
+    const void *map;
+    size_t count = column_map(path, sizeof(index_t), &map);
+    const index_t *index = map;
+    if (!count) {
+        log_print(LOG_ERROR, "ERROR: store: no index for \"%s\"\n", serial);
+        return -1;
+    }
+    // The index is in the order days were first written, which may not be
+    // chronological if history arrived late
+    uint32_t *days = malloc(count * sizeof(uint32_t));
+    size_t ndays = 0;
+    for (size_t i=0;i<count;i++) {
+        time_t start = (time_t)index[i].day * 86400;
+        if (start + index[i].first * 60 < to && start + index[i].last * 60 + 60 > from) {
+            days[ndays++] = index[i].day;
+        }
+    }
+    munmap((void *)map, count * sizeof(index_t));
+    for (size_t i=1;i<ndays;i++) {
+        uint32_t d = days[i];
+        size_t j = i;
+        for (;j>0 && days[j-1]>d;j--) {
+            days[j] = days[j-1];
+        }
+        days[j] = d;
+    }
+
+    group_t g = { 0 };
+    time_t block = -1;
+    long offset = 0;
+    for (size_t i=0;i<ndays;i++) {
+        if (i && days[i] == days[i-1]) {
+            continue;
+        }
+        time_t t = (time_t)days[i] * 86400;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        const void *minmap, *ampmap;
+        snprintf(path, sizeof(path), "%s/%s/%04d%02d%02d.min", dir, serial, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        size_t nmin = column_map(path, sizeof(uint16_t), &minmap);
+        snprintf(path, sizeof(path), "%s/%s/%04d%02d%02d.amp", dir, serial, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        size_t namp = column_map(path, sizeof(uint16_t), &ampmap);
+        // One value per minute, the last stored wins
+        int32_t minutes[MINUTES_PER_DAY];
+        for (int m=0;m<MINUTES_PER_DAY;m++) {
+            minutes[m] = -1;
+        }
+        const uint16_t *mins = minmap, *amps = ampmap;
+        size_t n = nmin < namp ? nmin : namp;
+        for (size_t j=0;j<n;j++) {
+            if (mins[j] < MINUTES_PER_DAY) {
+                minutes[mins[j]] = amps[j];
+            }
+        }
+        if (minmap) {
+            munmap((void *)minmap, nmin * sizeof(uint16_t));
+        }
+        if (ampmap) {
+            munmap((void *)ampmap, namp * sizeof(uint16_t));
+        }
+        for (int m=0;m<MINUTES_PER_DAY;m++) {
+            time_t when = t + m * 60;
+            if (minutes[m] < 0 || when < from || when >= to) {
+                continue;
+            }
+            if (group && when / 900 != block) {
+                block = when / 900;     // offsets only change on a quarter hour
+                offset = reading_offset(when);
+            }
+            time_t start = group ? (when + offset) / group * group - offset : from;
+            if (start != g.start || !g.minutes) {
+                group_print(serial, &g, voltage);
+                memset(&g, 0, sizeof(g));
+                g.start = start;
+                g.min = UINT16_MAX;
+            }
+            g.minutes++;
+            g.amps += minutes[m];
+            if (minutes[m] < g.min) {
+                g.min = minutes[m];
+            }
+            if (minutes[m] > g.max) {
+                g.max = minutes[m];
+            }
+        }
+    }
+    group_print(serial, &g, voltage);
+    free(days);
+    return 0;
+}
+
+int store_query(const char *dir, const char *serial, time_t from, time_t to, int group, int voltage) {
+    if (serial) {
+        return query_serial(dir, serial, from, to, group, voltage);
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        log_print(LOG_ERROR, "ERROR: store: opendir \"%s\": %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct dirent *e;
+    int r = 0;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] != '.' && query_serial(dir, e->d_name, from, to, group, voltage) < 0) {
+            r = -1;
+        }
+    }
+    closedir(d);
+    return r;
+}
@@ -0,0 +1,61 @@
+/*
+ * Local time-series store for CM160 readings.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Readings are kept under a directory, one subdirectory per device serial,
+ * partitioned by (UTC) day. Each day is stored as three append-only column
+ * files of fixed-width values:
+ *
+ *   YYYYMMDD.min   uint16  minute of the day the reading is for
+ *   YYYYMMDD.amp   uint16  raw amps as reported by the unit (x 0.07 for amps)
+ *   YYYYMMDD.flg   uint8   STORE_NEW, STORE_MORE
+ *
+ * so a reading costs five bytes and an aggregate only reads the columns it
+ * needs. Each serial also has an "index" file of one entry per day, giving
+ * the number of readings and the first and last minute seen, which lets a
+ * query skip whole days without opening them.
+ *
+ * History is often reported more than once, so a query counts each minute
+ * once, using the most recently stored reading for it.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define STORE_NEW       0x01    // a live reading, not history
+#define STORE_MORE      0x02    // the unit said it has more data
+
+typedef struct store_struct store_t;
+
+/**
+ * Open (creating if necessary) the store in "dir" for writing.
+ * Returns NULL on failure, having printed why.
+ */
+store_t *store_open(const char *dir);
+
+/**
+ * Close the store, updating the indexes.
+ */
+void store_close(store_t *store);
+
+/**
+ * Append a reading. Returns 0 on success or -1 on failure.
+ */
+int store_append(store_t *store, const char *serial, time_t when, uint16_t amps, uint8_t flags);
+
+/**
+ * Print aggregates for the readings in [from, to) as JSON, one line per
+ * serial and group. "group" is the length of each group in seconds,
+ * aligned to local midnight in standard time, as the unit's clock is read,
+ * or 0 for one group covering the whole range. "serial" may be NULL for all devices. Returns 0 on success.
+ */
+int store_query(const char *dir, const char *serial, time_t from, time_t to, int group, int voltage);
+
+#endif
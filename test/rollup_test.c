@@ -0,0 +1,137 @@
+/*
+ * Check that rollup windows line up with the unit's days across DST
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Build and run from the top directory with
+ *
+ *   gcc -Wall -I. test/rollup_test.c -o rollup_test && ./rollup_test
+ *
+ * It runs in Europe/London whatever TZ is, and feeds a day of readings
+ * timestamped as unit_time() would, in winter and in summer, with the
+ * windows set up in the other season. Each day must be published as one
+ * window starting at the unit's midnight. Then the unit's clock is set
+ * back months, part way through a day, which must publish that day as far
+ * as it got and carry on from the new time.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../rollup.c"
+
+char mqtt_topic[100] = "cm160";
+char hostname[100] = "test";
+char *programname = "rollup_test";
+int voltage = 230;
+int debug = 0;
+
+static int published;
+static int64_t published_start[8];
+static int published_minutes[8];
+
+uint64_t millis() {
+    return 0;
+}
+
+void log_print(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+int publish(const char *topic, const void *payload, int len) {
+    const char *s;
+    if (published == 8) {
+        return 0;
+    }
+    if ((s = strstr(payload, "\"start\":"))) {
+        published_start[published] = strtoll(s + 8, NULL, 10);
+    }
+    if ((s = strstr(payload, "\"minutes\":"))) {
+        published_minutes[published] = atoi(s + 10);
+    }
+    published++;
+    return 0;
+}
+
+/**
+ * Feed "minutes" readings from "from"
+ */
+static void feed(rollup_t *rollup, time_t from, int minutes) {
+    for (int m=0;m<minutes;m++) {
+        reading_t reading = { .unitwhen = from + m * 60, .amps = 100 };
+        rollup_add(rollup, "TEST", &reading, false);
+    }
+}
+
+/**
+ * Return midnight on the day given as the unit would: local time, read as standard time
+ */
+static time_t unit_midnight(int year, int mon, int mday) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon - 1;
+    tm.tm_mday = mday;
+    return mktime(&tm);
+}
+
+/**
+ * Feed a day of readings and the first minute of the next, and check the
+ * day is published as one window. Returns 0 if it is.
+ */
+static int check_day(int year, int mon, int mday) {
+    time_t midnight = unit_midnight(year, mon, mday);
+    rollup_t *rollup = rollup_new();
+    published = 0;
+    feed(rollup, midnight, 1441);
+    rollup_flush(rollup, "TEST");
+    free(rollup);
+    if (published != 1 || published_start[0] != midnight || published_minutes[0] != 1440) {
+        printf("FAIL: %04d-%02d-%02d: %d windows, the first starting at %" PRId64 " with %d minutes; wanted 1 at %ld with 1440\n", year, mon, mday, published, published_start[0], published_minutes[0], (long)midnight);
+        return 1;
+    }
+    printf("ok: %04d-%02d-%02d\n", year, mon, mday);
+    return 0;
+}
+
+/**
+ * Feed half of a summer day, set the clock back to a winter day and feed
+ * all of that, and check both are published. Returns 0 if they are.
+ */
+static int check_clock_back() {
+    time_t summer = unit_midnight(2023, 7, 15), winter = unit_midnight(2023, 1, 15);
+    rollup_t *rollup = rollup_new();
+    published = 0;
+    feed(rollup, summer, 720);
+    rollup_flush(rollup, "TEST");
+    feed(rollup, winter, 1441);
+    rollup_flush(rollup, "TEST");
+    free(rollup);
+    if (published != 2 || published_start[0] != summer || published_minutes[0] != 720 || published_start[1] != winter || published_minutes[1] != 1440) {
+        printf("FAIL: clock set back: %d windows; wanted %ld with 720 minutes then %ld with 1440\n", published, (long)summer, (long)winter);
+        return 1;
+    }
+    printf("ok: clock set back\n");
+    return 0;
+}
+
+int main() {
+    setenv("TZ", "Europe/London", 1);
+    tzset();
+    int failed = 0;
+    rollup_parse("1d");
+    failed += check_day(2023, 1, 15);
+    failed += check_day(2023, 7, 15);
+    failed += check_day(2023, 3, 26);       // the clocks go forward
+    failed += check_day(2023, 10, 29);      // ... and back
+    failed += check_clock_back();
+    return failed ? 1 : 0;
+}